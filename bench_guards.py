@@ -0,0 +1,254 @@
+#!/usr/bin/env python3
+"""
+Microbenchmark of guard checks.
+
+Call the check function of guards in a C loop using fat._bench_check() to
+measure the cost of the check without the overhead of a Python call.
+
+For each guard type, measure checks which pass, checks taking the slow path
+(a watched object was modified, but the guard still passes) and failing
+checks. For slow checks, the cost of the modification is measured separately
+and subtracted.
+"""
+import argparse
+import fat
+import sys
+
+
+GLOBAL_KEY = 1
+GLOBAL_OTHER = 1
+
+
+class Base:
+    def method(self):
+        pass
+
+
+class Class(Base):
+    counter = 0
+
+
+class Point:
+    def __init__(self, x, y):
+        self.x = x
+        self.y = y
+
+
+def func2():
+    pass
+
+
+class Bench:
+    def __init__(self, loops):
+        self.loops = loops
+        self.results = []
+
+    def bench(self, name, case, guard, args=(), kwargs=None, modify=None,
+              expected=0):
+        dt, res = fat._bench_check(guard, args, kwargs,
+                                   loops=self.loops, modify=modify)
+        if res != expected:
+            raise Exception("%s (%s): check returned %s, expected %s"
+                            % (name, case, res, expected))
+        if modify is not None:
+            dt -= fat._bench_check(None, loops=self.loops, modify=modify)[0]
+        ns = max(dt, 0.0) * 1e9 / self.loops
+        self.results.append((name, case, ns))
+        print("%-40s %-6s %8.1f ns" % (name, case, ns))
+        sys.stdout.flush()
+
+
+def specialized_guard(guard):
+    # bind the guard to a function: required by guards on arguments
+    def func(a, b=None, *, c=None):
+        pass
+
+    def fast(a, b=None, *, c=None):
+        pass
+
+    fat.specialize(func, fast, [guard])
+    return guard
+
+
+def bench_dict(bench):
+    for nkey in (1, 4, 16):
+        keys = ['key%s' % i for i in range(nkey)]
+        ns = dict.fromkeys(keys, 1)
+        ns['other'] = 1
+        name = 'GuardDict (%s keys)' % nkey
+
+        guard = fat.GuardDict(ns, *keys)
+        bench.bench(name, 'pass', guard)
+        bench.bench(name, 'slow', guard, modify=(ns, 'other'))
+        bench.bench(name, 'fail', guard, modify=(ns, keys[-1]), expected=2)
+
+    ns = {'key': 1, 'other': 1}
+    guards = [fat.GuardDict(ns, 'key') for i in range(10)]
+    bench.bench('GuardDict (10 guards on a dict)', 'slow', guards[0],
+                modify=(ns, 'other'))
+
+    ns = {'key': 1, 'other': 1}
+    guard = fat.GuardFrozenDict(ns)
+    name = 'GuardFrozenDict'
+    bench.bench(name, 'pass', guard)
+    bench.bench(name, 'fail', guard, modify=(ns, 'other'), expected=2)
+
+    guard = fat.GuardFrozenDict(ns, 'key', fallback=True)
+    name = 'GuardFrozenDict (fallback)'
+    bench.bench(name, 'pass', guard)
+    bench.bench(name, 'slow', guard, modify=(ns, 'other'))
+
+
+def bench_globals(bench):
+    namespace = globals()
+
+    guard = fat.GuardGlobals('GLOBAL_KEY')
+    name = 'GuardGlobals'
+    bench.bench(name, 'pass', guard)
+    bench.bench(name, 'slow', guard, modify=(namespace, 'GLOBAL_OTHER'))
+    bench.bench(name, 'fail', guard, modify=(namespace, 'GLOBAL_KEY'),
+                expected=2)
+    namespace['GLOBAL_KEY'] = 1
+
+    guard = fat.GuardBuiltins('len')
+    name = 'GuardBuiltins'
+    bench.bench(name, 'pass', guard)
+    bench.bench(name, 'slow', guard, modify=(namespace, 'GLOBAL_OTHER'))
+    bench.bench(name, 'fail', guard, modify=(namespace, 'len'),
+                expected=2)
+    del namespace['len']
+
+    guard = fat.GuardModuleAttr('sys.maxsize')
+    name = 'GuardModuleAttr (2 names)'
+    bench.bench(name, 'pass', guard)
+    bench.bench(name, 'slow', guard, modify=(namespace, 'GLOBAL_OTHER'))
+
+
+def bench_func(bench):
+    def func():
+        pass
+
+    guard = fat.GuardFunc(func)
+    bench.bench('GuardFunc', 'pass', guard)
+    func.__code__ = func2.__code__
+    bench.bench('GuardFunc', 'fail', guard, expected=2)
+
+
+def bench_arg_type(bench):
+    types = [str, bytes, float, complex, list, tuple, dict, set,
+             frozenset, bytearray, type, range, slice, memoryview, object]
+    for ntype in (1, 4, 16):
+        # worst case: the last type matches
+        arg_types = types[:ntype - 1] + [int]
+        name = 'GuardArgType (%s types)' % ntype
+        guard = specialized_guard(fat.GuardArgType(0, arg_types))
+
+        bench.bench(name, 'pass', guard, args=(5,))
+        bench.bench(name, 'fail', guard, args=(Point(1, 2),), expected=1)
+
+    guard = specialized_guard(fat.GuardArgType(2, [type(None)]))
+    name = 'GuardArgType (keyword)'
+    bench.bench(name, 'pass', guard, args=(1,), kwargs={'c': None})
+    bench.bench(name, 'fail', guard, args=(1,), kwargs={'c': 1}, expected=1)
+
+
+def bench_signature(bench):
+    for nparam in (1, 4):
+        name = 'GuardSignature (%s args)' % nparam
+        arg_types = [(int,)] * nparam
+        guard = fat.GuardSignature(arg_types)
+        bench.bench(name, 'pass', guard, args=(1,) * nparam)
+        bench.bench(name, 'fail', guard, args=(1,) * (nparam - 1) + ("x",),
+                    expected=1)
+
+
+def bench_type_dispatch(bench):
+    guard = fat.GuardTypeDispatch([0], fallback=func2)
+    types = (int, str, float, bytes)
+    for arg_type in types:
+        guard.register((arg_type,), func2)
+
+    name = 'GuardTypeDispatch (4 types)'
+    bench.bench(name, 'pass', guard, args=(1,))
+    bench.bench(name, 'fail', guard, args=([],), expected=1)
+
+
+def bench_type_version(bench):
+    guard = fat.GuardTypeVersion(Class, 'method')
+    name = 'GuardTypeVersion'
+    bench.bench(name, 'pass', guard)
+    bench.bench(name, 'slow', guard, modify=(Class, 'counter'))
+
+    guard = fat.GuardTypeVersion(Class)
+    bench.bench(name, 'fail', guard, modify=(Base, 'counter'), expected=2)
+
+
+def bench_instance_layout(bench):
+    point = Point(1, 2)
+    guard = specialized_guard(fat.GuardInstanceLayout(0, point))
+    name = 'GuardInstanceLayout'
+    bench.bench(name, 'pass', guard, args=(Point(3, 4),))
+    bench.bench(name, 'fail', guard, args=(1,), expected=1)
+
+
+def bench_arg_value(bench):
+    values = [None, True, 5, "str"]
+    guard = specialized_guard(fat.GuardArgValue(0, values))
+    name = 'GuardArgValue (4 values)'
+    bench.bench(name, 'pass', guard, args=(None,))
+    bench.bench(name, 'pass', guard, args=("".join(["s", "tr"]),))
+    bench.bench(name, 'fail', guard, args=(6,), expected=1)
+
+
+def bench_arg_range(bench):
+    guard = specialized_guard(fat.GuardArgRange(0))
+    name = 'GuardArgRange'
+    bench.bench(name, 'pass', guard, args=(5,))
+    bench.bench(name, 'pass', guard, args=(2 ** 62,))
+    bench.bench(name, 'pass', guard, args=(1.5,))
+    bench.bench(name, 'fail', guard, args=(10 ** 100,), expected=1)
+
+
+def bench_arg_shape(bench):
+    guard = specialized_guard(fat.GuardArgShape(0, tuple, 3,
+                                                (float, float, float)))
+    name = 'GuardArgShape (3 items)'
+    bench.bench(name, 'pass', guard, args=((1.0, 2.0, 3.0),))
+    bench.bench(name, 'fail', guard, args=((1.0, 2.0),), expected=1)
+
+
+def bench_chain(bench):
+    namespace = globals()
+    guard_global = fat.GuardGlobals('GLOBAL_KEY')
+    guard_arg = fat.GuardArgType(0, (int,))
+    guard = specialized_guard(fat.GuardChain([guard_global, guard_arg]))
+    name = 'GuardChain (2 guards)'
+    bench.bench(name, 'pass', guard, args=(5,))
+    bench.bench(name, 'slow', guard, args=(5,),
+                modify=(namespace, 'GLOBAL_OTHER'))
+    bench.bench(name, 'fail', guard, args=("x",), expected=1)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip())
+    parser.add_argument('-n', '--loops', type=int, default=10 ** 6,
+                        help='number of checks per benchmark')
+    args = parser.parse_args()
+
+    bench = Bench(args.loops)
+    bench_dict(bench)
+    bench_globals(bench)
+    bench_func(bench)
+    bench_arg_type(bench)
+    bench_signature(bench)
+    bench_type_dispatch(bench)
+    bench_type_version(bench)
+    bench_instance_layout(bench)
+    bench_arg_value(bench)
+    bench_arg_range(bench)
+    bench_arg_shape(bench)
+    bench_chain(bench)
+
+
+if __name__ == "__main__":
+    main()
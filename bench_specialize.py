@@ -0,0 +1,259 @@
+#!/usr/bin/env python3
+"""
+End-to-end benchmark of specialized functions.
+
+Run each workload in three variants:
+
+* unspecialized: the original function
+* pass: the function specialized with guards which pass
+* fail: the function specialized with guards which (temporarily) fail, so
+  the original code is run after the guard checks
+
+Results can be written as JSON (--output) and compared to a previous run
+(--compare) to track regressions between releases of the fat module.
+"""
+import argparse
+import fat
+import json
+import platform
+import sys
+import time
+import types
+
+
+# Workload: builtin-inlining loop
+
+def sum_len(items):
+    total = 0
+    for item in items:
+        total += len(item)
+    return total
+
+
+def specialize_sum_len(func):
+    guard = fat.GuardBuiltins('len')
+    code = fat.inline_globals(func.__code__, guard)
+    fast = types.FunctionType(code, func.__globals__, func.__name__)
+    fat.specialize(func, fast, [guard, fat.GuardArgType(0, [list])])
+
+
+SUM_LEN_ITEMS = ['abc', (1, 2), [3], 'de'] * 25
+
+
+# Workload: method-heavy code
+
+class Vector:
+    def __init__(self, x, y):
+        self.x = x
+        self.y = y
+
+    def norm2(self):
+        return self.x * self.x + self.y * self.y
+
+
+class SubVector(Vector):
+    pass
+
+
+def vector_norms(vector, n):
+    total = 0
+    for i in range(n):
+        total += vector.norm2()
+    return total
+
+
+def make_vector_norms_fast(norm2):
+    def vector_norms(vector, n):
+        total = 0
+        for i in range(n):
+            total += norm2(vector)
+        return total
+    return vector_norms
+
+
+def specialize_vector_norms(func):
+    # the method lookup is hoisted out of the loop: the instance layout
+    # guard ensures that the instance dict doesn't override the method
+    guards = [fat.GuardInstanceLayout(0, Vector(1, 2)),
+              fat.GuardTypeVersion(Vector, 'norm2')]
+    fat.specialize(func, make_vector_norms_fast(Vector.norm2), guards)
+
+
+# Workload: module with frequent global rebinding
+
+NCALL = 0
+SCALE = 3
+
+
+def scale_values(values):
+    global NCALL
+    NCALL += 1
+    result = []
+    for value in values:
+        result.append(value * SCALE)
+    return result
+
+
+def specialize_scale_values(func):
+    # NCALL is rebound at each call: the guard takes its slow path
+    guard = fat.GuardGlobals('SCALE')
+    code = fat.inline_globals(func.__code__, guard)
+    fast = types.FunctionType(code, func.__globals__, func.__name__)
+    fat.specialize(func, fast, [guard, fat.GuardArgType(0, [list])])
+
+
+# Workload: polymorphic call site
+
+def add(a, b):
+    return a + b
+
+
+def add_int(a, b):
+    return a + b
+
+
+def add_float(a, b):
+    return a + b
+
+
+def add_str(a, b):
+    return a + b
+
+
+def specialize_add(func):
+    guard = fat.GuardTypeDispatch([0, 1])
+    guard.register((int, int), add_int)
+    guard.register((float, float), add_float)
+    guard.register((str, str), add_str)
+    fat.specialize(func, guard, [guard])
+
+
+WORKLOADS = [
+    # name, function, specialize, calls with passing guards,
+    # calls with failing guards
+    ('builtin_len_loop', sum_len, specialize_sum_len,
+     [(SUM_LEN_ITEMS,)],
+     [(tuple(SUM_LEN_ITEMS),)]),
+    ('method_calls', vector_norms, specialize_vector_norms,
+     [(Vector(1, 2), 50)],
+     [(SubVector(1, 2), 50)]),
+    ('global_rebinding', scale_values, specialize_scale_values,
+     [(list(range(50)),)],
+     [(tuple(range(50)),)]),
+    ('polymorphic_call', add, specialize_add,
+     [(1, 2), (1.5, 2.5), ('a', 'b')],
+     [([1], [2]), ((1,), (2,)), (b'a', b'b')]),
+]
+
+
+def copy_func(func):
+    return types.FunctionType(func.__code__, func.__globals__,
+                              func.__name__, func.__defaults__,
+                              func.__closure__)
+
+
+def bench_calls(func, calls, loops, repeat):
+    best = None
+    for run in range(repeat):
+        start = time.perf_counter()
+        for loop in range(loops):
+            for args in calls:
+                func(*args)
+        dt = time.perf_counter() - start
+        if best is None or dt < best:
+            best = dt
+    return best / (loops * len(calls))
+
+
+def run_benchmarks(args):
+    results = []
+    for name, func, specialize, pass_calls, fail_calls in WORKLOADS:
+        unspecialized = copy_func(func)
+        specialized = copy_func(func)
+        specialize(specialized)
+        if not fat.get_specialized(specialized):
+            raise Exception("%s: failed to specialize the function" % name)
+
+        # results must not depend on the specialization
+        for calls in (pass_calls, fail_calls):
+            for call_args in calls:
+                if specialized(*call_args) != unspecialized(*call_args):
+                    raise Exception("%s: specialized function returned "
+                                    "a different result" % name)
+
+        variants = (('unspecialized', unspecialized, pass_calls),
+                    ('pass', specialized, pass_calls),
+                    ('fail', specialized, fail_calls))
+        timings = {}
+        for variant, variant_func, calls in variants:
+            timing = bench_calls(variant_func, calls, args.loops, args.repeat)
+            timings[variant] = timing
+            results.append({'workload': name,
+                            'variant': variant,
+                            'seconds_per_call': timing})
+
+        print("%-20s unspecialized %8.0f ns  pass %8.0f ns (%+5.1f%%)  "
+              "fail %8.0f ns (%+5.1f%%)"
+              % (name, timings['unspecialized'] * 1e9,
+                 timings['pass'] * 1e9,
+                 percent(timings['pass'], timings['unspecialized']),
+                 timings['fail'] * 1e9,
+                 percent(timings['fail'], timings['unspecialized'])))
+        sys.stdout.flush()
+    return results
+
+
+def percent(value, ref):
+    return (value - ref) * 100.0 / ref
+
+
+def compare(results, filename):
+    with open(filename) as fp:
+        ref = json.load(fp)
+    ref_timings = {(result['workload'], result['variant']):
+                   result['seconds_per_call']
+                   for result in ref['results']}
+
+    print()
+    print("Compared to %s (fat %s):" % (filename, ref['fat_version']))
+    for result in results:
+        key = (result['workload'], result['variant'])
+        if key not in ref_timings:
+            continue
+        print("%-20s %-14s %+6.1f%%"
+              % (key[0], key[1],
+                 percent(result['seconds_per_call'], ref_timings[key])))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip(),
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('-n', '--loops', type=int, default=10000,
+                        help='number of loops per run')
+    parser.add_argument('-r', '--repeat', type=int, default=5,
+                        help='number of runs, keep the fastest')
+    parser.add_argument('-o', '--output',
+                        help='write results as JSON into this file')
+    parser.add_argument('-c', '--compare',
+                        help='compare results to a JSON file written by '
+                             '--output')
+    args = parser.parse_args()
+
+    results = run_benchmarks(args)
+
+    if args.compare:
+        compare(results, args.compare)
+
+    if args.output:
+        data = {'fat_version': fat.__version__,
+                'python_version': platform.python_version(),
+                'loops': args.loops,
+                'repeat': args.repeat,
+                'results': results}
+        with open(args.output, 'w') as fp:
+            json.dump(data, fp, indent=2, sort_keys=True)
+            fp.write('\n')
+
+
+if __name__ == "__main__":
+    main()
@@ -1,45 +1,395 @@
 #include "Python.h"
 #include "frameobject.h"
+#include "opcode.h"
 #include "structmember.h"
+#include "longintrepr.h"
 
 #define VERSION "0.3"
 
 static PyObject *init_builtins = NULL;
 
 #ifdef __GNUC__
+#  define likely(x) __builtin_expect(!!(x), 1)
 #  define unlikely(x) __builtin_expect(!!(x), 0)
 #else
+#  define likely(x) x
 #  define unlikely(x) x
 #endif
 
+/* Set FAT_STATS to 0 to disable statistics on guard checks */
+#ifndef FAT_STATS
+#  define FAT_STATS 1
+#endif
 
-/* GuardArgType */
+#if FAT_STATS
+#  define GUARD_STAT_INC(guard, field) ((guard)->field++)
+#else
+#  define GUARD_STAT_INC(guard, field)
+#endif
+
+/* Deoptimization policy: a guard is disabled when its decaying number of
+   temporary failures reaches deopt_threshold (0 means never). The number is
+   halved every deopt_window checks. */
+static Py_ssize_t deopt_threshold = 0;
+static Py_ssize_t deopt_window = 1000;
+
+
+/* Guard */
 
 typedef struct {
     PyFuncGuardObject base;
+    /* number of checks: always counted, the deoptimization policy uses it
+       to decay fail_score */
+    Py_ssize_t nb_check;
+    /* decaying number of temporary failures, see guard_count_fail() */
+    Py_ssize_t fail_score;
+    /* value of nb_check when fail_score was last decayed */
+    Py_ssize_t decay_check;
+    int disabled;
+#if FAT_STATS
+    /* number of failed checks */
+    Py_ssize_t nb_fail;
+    /* number of checks which revalidated the guard because a watched
+       object was modified */
+    Py_ssize_t nb_slow;
+#endif
+} GuardObject;
+
+static int
+guard_disabled_check(PyObject *self, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
+{
+    return 2;
+}
+
+static int
+guard_count_fail(GuardObject *guard, int res)
+{
+    Py_ssize_t nwindow;
+
+    if (res < 0)
+        return res;
+
+    GUARD_STAT_INC(guard, nb_fail);
+    if (res != 1 || deopt_threshold == 0)
+        return res;
+
+    nwindow = (guard->nb_check - guard->decay_check) / deopt_window;
+    if (nwindow > 0) {
+        if (nwindow < (Py_ssize_t)(sizeof(Py_ssize_t) * 8))
+            guard->fail_score >>= nwindow;
+        else
+            guard->fail_score = 0;
+        guard->decay_check += nwindow * deopt_window;
+    }
+
+    guard->fail_score++;
+    if (guard->fail_score < deopt_threshold)
+        return 1;
+
+    /* the guard fails too often: the specialized code is removed when a
+       guard check returns 2, and the guard now always fails */
+    guard->disabled = 1;
+    guard->base.check = guard_disabled_check;
+    return 2;
+}
+
+/* Update guard counters with the result of a check */
+static inline int
+guard_count_check(GuardObject *guard, int res)
+{
+    guard->nb_check++;
+    if (unlikely(res != 0))
+        return guard_count_fail(guard, res);
+    return 0;
+}
+
+#define GUARD_MEMBERS \
+    {"disabled",   T_INT,   offsetof(GuardObject, disabled), \
+     RESTRICTED|READONLY},
+
+
+/* Argument of a function checked by a guard */
+
+enum {
+    /* the guard was not used to specialize a function yet: arg_index is the
+       index in the positional arguments */
+    GUARD_ARG_UNBOUND,
+    GUARD_ARG_POSITIONAL,
+    GUARD_ARG_KWONLY,
+    /* item of *args */
+    GUARD_ARG_VARARGS
+};
+
+typedef struct {
+    /* index in positional arguments, as items of *args. Without *args,
+       indexes after positional parameters are keyword-only parameters. */
     Py_ssize_t arg_index;
+    int kind;
+    /* 1 if the guard is used by more than one function: default values
+       are not used, since they are read from func */
+    int shared;
+    /* index in positional arguments, or -1 for keyword-only parameters */
+    Py_ssize_t stack_index;
+    /* function, name of the parameter, or NULL */
+    PyObject *func;
+    PyObject *name;
+    /* index of the parameter in kwnames, or -1 if kwnames doesn't contain
+       the parameter name */
+    PyObject *kwnames;
+    Py_ssize_t kw_index;
+    /* default of a keyword-only parameter, borrowed reference valid while
+       the version of the kwdefaults dict is unchanged */
+    PyObject *kwdefaults;
+    PY_UINT64_T kwdefaults_version;
+    PyObject *kwdefault;
+} GuardArg;
+
+static void
+guard_arg_init(GuardArg *arg, Py_ssize_t arg_index)
+{
+    arg->arg_index = arg_index;
+    arg->kind = GUARD_ARG_UNBOUND;
+    arg->shared = 0;
+    arg->stack_index = arg_index;
+    arg->func = NULL;
+    arg->name = NULL;
+    arg->kwnames = NULL;
+    arg->kw_index = -1;
+    arg->kwdefaults = NULL;
+    arg->kwdefaults_version = 0;
+    arg->kwdefault = NULL;
+}
+
+static void
+guard_arg_clear(GuardArg *arg)
+{
+    Py_CLEAR(arg->func);
+    Py_CLEAR(arg->name);
+    Py_CLEAR(arg->kwnames);
+    Py_CLEAR(arg->kwdefaults);
+}
+
+/* Check the index of the argument passed to a guard constructor */
+static int
+guard_arg_check_index(int arg_index)
+{
+    if (arg_index < 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "arg_index must be positive or zero");
+        return -1;
+    }
+    return 0;
+}
+
+/* Set a new argument index when a guard is initialized again: the guard is
+   unbound from its function */
+static void
+guard_arg_reset(GuardArg *arg, Py_ssize_t arg_index)
+{
+    guard_arg_clear(arg);
+    guard_arg_init(arg, arg_index);
+}
+
+static int
+guard_arg_traverse(GuardArg *garg, visitproc visit, void *arg)
+{
+    Py_VISIT(garg->func);
+    Py_VISIT(garg->name);
+    Py_VISIT(garg->kwnames);
+    Py_VISIT(garg->kwdefaults);
+    return 0;
+}
+
+/* Bind the argument to the function: get the parameter name and kind from
+   the code of the function.
+
+   A guard can be used by more than one function if they resolve the
+   argument the same way. */
+static int
+guard_arg_bind(GuardArg *arg, PyObject *func)
+{
+    PyCodeObject *code;
+    Py_ssize_t argcount, nparam, stack_index;
+    PyObject *name = NULL;
+    int kind;
+
+    if (arg->func == func)
+        return 0;
+
+    code = (PyCodeObject *)((PyFunctionObject *)func)->func_code;
+    argcount = code->co_argcount;
+    nparam = argcount + code->co_kwonlyargcount;
+
+    if (arg->arg_index < argcount) {
+        kind = GUARD_ARG_POSITIONAL;
+        stack_index = arg->arg_index;
+        name = PyTuple_GET_ITEM(code->co_varnames, arg->arg_index);
+    }
+    else if (code->co_flags & CO_VARARGS) {
+        kind = GUARD_ARG_VARARGS;
+        stack_index = arg->arg_index;
+    }
+    else if (arg->arg_index < nparam) {
+        kind = GUARD_ARG_KWONLY;
+        stack_index = -1;
+        name = PyTuple_GET_ITEM(code->co_varnames, arg->arg_index);
+    }
+    else {
+        PyErr_Format(PyExc_ValueError,
+                     "arg_index %zd is out of range: the function has %zd "
+                     "parameters and no *args",
+                     arg->arg_index, nparam);
+        return -1;
+    }
+
+    if (arg->func != NULL) {
+        /* the guard is already used by another function */
+        if (kind != arg->kind
+            || stack_index != arg->stack_index
+            || (name != arg->name
+                && (name == NULL || arg->name == NULL
+                    || PyUnicode_Compare(name, arg->name) != 0))) {
+            PyErr_SetString(PyExc_ValueError,
+                            "guard already used to specialize a function "
+                            "with an incompatible signature");
+            return -1;
+        }
+        arg->shared = 1;
+        return 0;
+    }
+
+    Py_XINCREF(name);
+    arg->name = name;
+    arg->kind = kind;
+    arg->stack_index = stack_index;
+    Py_INCREF(func);
+    arg->func = func;
+    return 0;
+}
+
+/* Find the argument passed by keyword, the index is cached for the
+   kwnames tuple of the call site */
+static Py_ssize_t
+guard_arg_find_keyword(GuardArg *arg, PyObject *kwnames)
+{
+    Py_ssize_t i, nkwargs;
+
+    if (likely(kwnames == arg->kwnames))
+        return arg->kw_index;
+
+    nkwargs = PyTuple_GET_SIZE(kwnames);
+    for (i=0; i < nkwargs; i++) {
+        PyObject *name = PyTuple_GET_ITEM(kwnames, i);
+
+        if (name == arg->name
+            || PyUnicode_Compare(name, arg->name) == 0)
+            break;
+    }
+    if (i == nkwargs)
+        i = -1;
+
+    Py_INCREF(kwnames);
+    Py_XSETREF(arg->kwnames, kwnames);
+    arg->kw_index = i;
+    return i;
+}
+
+/* Get the default value of a parameter, or NULL if the parameter has no
+   default value */
+static PyObject*
+guard_arg_get_default(GuardArg *arg)
+{
+    PyFunctionObject *func = (PyFunctionObject *)arg->func;
+
+    if (arg->kind == GUARD_ARG_POSITIONAL) {
+        PyObject *defaults = func->func_defaults;
+        Py_ssize_t argcount, index;
+
+        /* func.__defaults__ can be replaced: read the current tuple */
+        if (defaults == NULL)
+            return NULL;
+        argcount = ((PyCodeObject *)func->func_code)->co_argcount;
+        index = arg->arg_index - (argcount - PyTuple_GET_SIZE(defaults));
+        if (index < 0)
+            return NULL;
+        return PyTuple_GET_ITEM(defaults, index);
+    }
+
+    if (arg->kind == GUARD_ARG_KWONLY) {
+        PyObject *kwdefaults = func->func_kwdefaults;
+
+        if (kwdefaults == NULL)
+            return NULL;
+
+        if (unlikely(kwdefaults != arg->kwdefaults
+                     || (((PyDictObject *)kwdefaults)->ma_version_tag
+                         != arg->kwdefaults_version))) {
+            Py_INCREF(kwdefaults);
+            Py_XSETREF(arg->kwdefaults, kwdefaults);
+            arg->kwdefaults_version = ((PyDictObject *)kwdefaults)->ma_version_tag;
+            arg->kwdefault = PyDict_GetItem(kwdefaults, arg->name);
+        }
+        return arg->kwdefault;
+    }
+
+    return NULL;
+}
+
+/* Get the argument. Return 0 on success, or 1 if the argument is missing. */
+static int
+guard_arg_get(GuardArg *arg, PyObject **stack, Py_ssize_t nargs,
+              PyObject *kwnames, PyObject **parg)
+{
+    if ((size_t)arg->stack_index < (size_t)nargs) {
+        *parg = stack[arg->stack_index];
+        return 0;
+    }
+
+    if (kwnames != NULL && arg->name != NULL) {
+        Py_ssize_t kw_index = guard_arg_find_keyword(arg, kwnames);
+        if (kw_index >= 0) {
+            *parg = stack[nargs + kw_index];
+            return 0;
+        }
+    }
+
+    if (arg->func != NULL && !arg->shared) {
+        *parg = guard_arg_get_default(arg);
+        if (*parg != NULL)
+            return 0;
+    }
+
+    return 1;
+}
+
+
+/* GuardArgType */
+
+typedef struct {
+    GuardObject base;
+    GuardArg arg;
     Py_ssize_t nb_arg_type;
     PyObject** arg_types;
 } GuardArgTypeObject;
 
 static int
-guard_arg_type_check(PyObject *self, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
+guard_arg_type_init_guard(PyObject *self, PyObject *func)
 {
     GuardArgTypeObject *guard = (GuardArgTypeObject *)self;
+
+    return guard_arg_bind(&guard->arg, func);
+}
+
+static int
+check_arg_type_guard(GuardArgTypeObject *guard, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
+{
     PyObject *arg;
     PyTypeObject *type;
     Py_ssize_t i;
     int res;
 
-    if (kwnames != NULL && PyTuple_GET_SIZE(kwnames) != 0) {
-        /* FIXME: implement keywords */
-        return 1;
-    }
-
-    if (guard->arg_index >= nargs)
+    if (guard_arg_get(&guard->arg, stack, nargs, kwnames, &arg))
         return 1;
-
-    arg = stack[guard->arg_index];
     type = Py_TYPE(arg);
 
     res = 1;
@@ -53,15 +403,34 @@ guard_arg_type_check(PyObject *self, PyObject **stack, Py_ssize_t nargs, PyObjec
     return res;
 }
 
+static int
+guard_arg_type_check(PyObject *self, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
+{
+    GuardArgTypeObject *guard = (GuardArgTypeObject *)self;
+
+    return guard_count_check(&guard->base,
+                             check_arg_type_guard(guard, stack, nargs, kwnames));
+}
+
+static void
+guard_arg_type_clear(GuardArgTypeObject *self)
+{
+    Py_ssize_t i;
+
+    for (i=0; i < self->nb_arg_type; i++)
+        Py_CLEAR(self->arg_types[i]);
+    PyMem_Free(self->arg_types);
+    self->arg_types = NULL;
+    self->nb_arg_type = 0;
+}
+
 static void
 guard_arg_type_dealloc(GuardArgTypeObject *self)
 {
     GuardArgTypeObject *guard = (GuardArgTypeObject *)self;
-    Py_ssize_t i;
 
-    for (i=0; i < guard->nb_arg_type; i++)
-        Py_CLEAR(guard->arg_types[i]);
-    PyMem_Free(guard->arg_types);
+    guard_arg_type_clear(guard);
+    guard_arg_clear(&guard->arg);
 
     PyFuncGuard_Type.tp_dealloc((PyObject *)self);
 }
@@ -74,7 +443,7 @@ guard_arg_type_traverse(GuardArgTypeObject *self, visitproc visit, void *arg)
 
     for (i=0; i < guard->nb_arg_type; i++)
         Py_VISIT(guard->arg_types[i]);
-    return 0;
+    return guard_arg_traverse(&guard->arg, visit, arg);
 }
 
 static PyObject *
@@ -88,8 +457,9 @@ guard_arg_type_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
         return NULL;
 
     self = (GuardArgTypeObject *)op;
-    self->base.check = guard_arg_type_check;
-    self->arg_index = 0;
+    self->base.base.init = guard_arg_type_init_guard;
+    self->base.base.check = guard_arg_type_check;
+    guard_arg_init(&self->arg, 0);
     self->nb_arg_type = 0;
     self->arg_types = NULL;
 
@@ -111,6 +481,8 @@ guard_arg_type_init(PyObject *op, PyObject *args, PyObject *kwargs)
     if (!PyArg_ParseTupleAndKeywords(args, kwargs, "iO:GuardArgType", keywords,
                                      &arg_index, &arg_types_obj))
         return -1;
+    if (guard_arg_check_index(arg_index) < 0)
+        return -1;
 
     seq = PySequence_Fast(arg_types_obj, "arg_types must be a type or an iterable");
     if (seq == NULL)
@@ -149,7 +521,8 @@ guard_arg_type_init(PyObject *op, PyObject *args, PyObject *kwargs)
 
     Py_CLEAR(seq);
 
-    self->arg_index = arg_index;
+    guard_arg_type_clear(self);
+    guard_arg_reset(&self->arg, arg_index);
     self->nb_arg_type = nb_arg_type;
     self->arg_types = arg_types;
     return 0;
@@ -186,11 +559,28 @@ static PyGetSetDef guard_arg_type_getsetlist[] = {
 };
 
 static PyMemberDef guard_arg_type_members[] = {
-    {"arg_index",   T_INT,   offsetof(GuardArgTypeObject, arg_index),
+    {"arg_index",   T_PYSSIZET,   offsetof(GuardArgTypeObject, arg.arg_index),
      RESTRICTED|READONLY},
+    {"arg_name",   T_OBJECT,   offsetof(GuardArgTypeObject, arg.name),
+     RESTRICTED|READONLY},
+    GUARD_MEMBERS
     {NULL}  /* Sentinel */
 };
 
+PyDoc_STRVAR(guard_arg_type_doc,
+"GuardArgType(arg_index, arg_types)\n"
+"\n"
+"Guard on the type of a function argument.\n"
+"\n"
+"arg_index is the index in positional arguments, including items of\n"
+"*args. If the function has no *args, indexes after the positional\n"
+"parameters are keyword-only parameters. If the argument is missing, the\n"
+"type of the default value of the parameter is checked.\n"
+"\n"
+"The guard can be used to specialize more than one function if the\n"
+"argument has the same position and name in all functions. Default\n"
+"values are then not checked: a missing argument fails.");
+
 static PyTypeObject GuardArgType_Type = {
     PyVarObject_HEAD_INIT(&PyType_Type, 0)
     "fat.GuardArgType",
@@ -212,7 +602,7 @@ static PyTypeObject GuardArgType_Type = {
     0,                                          /* tp_setattro */
     0,                                          /* tp_as_buffer */
     Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
-    0,                                          /* tp_doc */
+    guard_arg_type_doc,                         /* tp_doc */
     (traverseproc)guard_arg_type_traverse,      /* tp_traverse */
     0,                                          /* tp_clear */
     0,                                          /* tp_richcompare */
@@ -234,126 +624,342 @@ static PyTypeObject GuardArgType_Type = {
 };
 
 
-/* GuardFunc */
+/* GuardSignature */
 
 typedef struct {
-    PyFuncGuardObject base;
-    PyObject *func;
-    PyObject *code;
-} GuardFuncObject;
+    GuardObject base;
+    Py_ssize_t nparam;
+    /* types of the parameter i are types[type_index[i]:type_index[i+1]],
+       no type means any type. Both arrays are allocated in one block. */
+    Py_ssize_t *type_index;
+    PyTypeObject **types;
+    /* parameters, used to get arguments passed by keyword or missing
+       arguments with a default value */
+    GuardArg *args;
+} GuardSignatureObject;
 
 static int
-guard_func_init_guard(PyObject *self, PyObject *func)
+check_signature_guard(GuardSignatureObject *guard, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
 {
-    GuardFuncObject *guard = (GuardFuncObject *)self;
+    PyTypeObject **types = guard->types;
+    Py_ssize_t *type_index = guard->type_index;
+    Py_ssize_t i;
 
-    if ((PyObject *)func == guard->func) {
-        /* Replacing the code object of a function already removes its
-         * specialized code, no need to add a guard */
-        PyErr_SetString(PyExc_ValueError,
-                        "useless GuardFunc, a function already watch itself");
-        return -1;
+    for (i=0; i < guard->nparam; i++) {
+        PyObject *arg;
+        PyTypeObject *type;
+        PyTypeObject **item = &types[type_index[i]];
+        PyTypeObject **end = &types[type_index[i+1]];
+
+        if (likely(i < nargs))
+            arg = stack[i];
+        else if (guard_arg_get(&guard->args[i], stack, nargs, kwnames, &arg))
+            return 1;
+
+        if (item == end) {
+            /* any type */
+            continue;
+        }
+
+        type = Py_TYPE(arg);
+        while (*item != type) {
+            item++;
+            if (item == end)
+                return 1;
+        }
     }
+
     return 0;
 }
 
 static int
-guard_func_check(PyObject *self, PyObject** stack, Py_ssize_t nargs, PyObject *kwnames)
+guard_signature_check(PyObject *self, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
 {
-    GuardFuncObject *guard = (GuardFuncObject *)self;
-    PyFunctionObject *func;
+    GuardSignatureObject *guard = (GuardSignatureObject *)self;
 
-    assert(Py_TYPE(guard->func) == &PyFunction_Type);
-    func = (PyFunctionObject *)guard->func;
+    return guard_count_check(&guard->base,
+                             check_signature_guard(guard, stack, nargs, kwnames));
+}
 
-    if (((PyFunctionObject *)func)->func_code != guard->code)
-        return 2;
+static int
+guard_signature_init_guard(PyObject *self, PyObject *func)
+{
+    GuardSignatureObject *guard = (GuardSignatureObject *)self;
+    Py_ssize_t i;
 
+    for (i=0; i < guard->nparam; i++) {
+        if (guard_arg_bind(&guard->args[i], func) < 0)
+            return -1;
+    }
     return 0;
 }
 
 static void
-guard_func_dealloc(GuardFuncObject *self)
+guard_signature_clear(GuardSignatureObject *guard)
 {
-    GuardFuncObject *guard = (GuardFuncObject *)self;
+    Py_ssize_t i;
 
-    Py_XDECREF(guard->func);
-    Py_XDECREF(guard->code);
+    if (guard->type_index != NULL) {
+        for (i=0; i < guard->type_index[guard->nparam]; i++)
+            Py_DECREF(guard->types[i]);
+    }
+    if (guard->args != NULL) {
+        for (i=0; i < guard->nparam; i++)
+            guard_arg_clear(&guard->args[i]);
+    }
+    PyMem_Free(guard->args);
+    guard->args = NULL;
+    PyMem_Free(guard->type_index);
+    guard->type_index = NULL;
+    guard->types = NULL;
+    guard->nparam = 0;
+}
+
+static void
+guard_signature_dealloc(GuardSignatureObject *self)
+{
+    guard_signature_clear(self);
 
     PyFuncGuard_Type.tp_dealloc((PyObject *)self);
 }
 
 static int
-guard_func_traverse(GuardFuncObject *self, visitproc visit, void *arg)
+guard_signature_traverse(GuardSignatureObject *self, visitproc visit, void *arg)
 {
-    GuardFuncObject *guard = (GuardFuncObject *)self;
+    Py_ssize_t i;
 
-    Py_VISIT(guard->func);
-    Py_VISIT(guard->code);
+    if (self->type_index != NULL) {
+        for (i=0; i < self->type_index[self->nparam]; i++)
+            Py_VISIT(self->types[i]);
+    }
+    if (self->args != NULL) {
+        for (i=0; i < self->nparam; i++) {
+            int res = guard_arg_traverse(&self->args[i], visit, arg);
+            if (res)
+                return res;
+        }
+    }
     return 0;
 }
 
 static PyObject *
-guard_func_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+guard_signature_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
     PyObject *op;
-    GuardFuncObject *self;
+    GuardSignatureObject *self;
 
     op = PyFuncGuard_Type.tp_new(type, args, kwds);
     if (op == NULL)
         return NULL;
 
-    self = (GuardFuncObject *)op;
-    self->base.init = guard_func_init_guard;
-    self->base.check = guard_func_check;
-    self->func = NULL;
-    self->code = NULL;
+    self = (GuardSignatureObject *)op;
+    self->base.base.init = guard_signature_init_guard;
+    self->base.base.check = guard_signature_check;
+    self->nparam = 0;
+    self->type_index = NULL;
+    self->types = NULL;
+    self->args = NULL;
 
     return op;
 }
 
-static int
-guard_func_init(PyObject *op, PyObject *args, PyObject *kwargs)
+/* Get the types of a parameter as a tuple: (), (type,) or a tuple of types */
+static PyObject*
+guard_signature_param_types(PyObject *obj)
 {
-    GuardFuncObject *self = (GuardFuncObject *)op;
-    static char *keywords[] = {"func", NULL};
-    PyObject *func;
-    PyObject *code;
+    PyObject *types;
+    Py_ssize_t i;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O:GuardFunc", keywords,
-                                     &func))
-        return -1;
+    if (obj == Py_None)
+        return PyTuple_New(0);
 
-    if (!PyFunction_Check(func)) {
-        PyErr_Format(PyExc_TypeError,
-                     "func must be a function, not %s",
-                     Py_TYPE(func)->tp_name);
-        return -1;
+    if (PyType_Check(obj))
+        return PyTuple_Pack(1, obj);
+
+    types = PySequence_Tuple(obj);
+    if (types == NULL) {
+        if (PyErr_ExceptionMatches(PyExc_TypeError)) {
+            PyErr_SetString(PyExc_TypeError,
+                            "parameter types must be None, a type or "
+                            "an iterable");
+        }
+        return NULL;
     }
 
-    code = ((PyFunctionObject*)func)->func_code;
+    for (i=0; i < PyTuple_GET_SIZE(types); i++) {
+        PyObject *type = PyTuple_GET_ITEM(types, i);
+        if (!PyType_Check(type)) {
+            PyErr_Format(PyExc_TypeError,
+                         "arg_type must be a type, got %s",
+                         Py_TYPE(type)->tp_name);
+            Py_DECREF(types);
+            return NULL;
+        }
+    }
+    return types;
+}
 
-    Py_INCREF(func);
-    self->func = func;
-    Py_INCREF(code);
-    self->code = code;
+static int
+guard_signature_init(PyObject *op, PyObject *args, PyObject *kwargs)
+{
+    GuardSignatureObject *self = (GuardSignatureObject *)op;
+    static char *keywords[] = {"arg_types", NULL};
+    PyObject *arg_types_obj;
+    PyObject *seq = NULL, *param_types = NULL;
+    Py_ssize_t nparam, ntype, i, j;
+    Py_ssize_t *type_index = NULL;
+    PyTypeObject **types;
+    GuardArg *garg;
+    size_t size;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O:GuardSignature", keywords,
+                                     &arg_types_obj))
+        return -1;
+
+    seq = PySequence_Fast(arg_types_obj, "arg_types must be an iterable");
+    if (seq == NULL)
+        goto error;
+
+    nparam = PySequence_Fast_GET_SIZE(seq);
+    if (nparam == 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "need at least one parameter");
+        goto error;
+    }
+
+    /* replace items with tuples of types */
+    param_types = PyTuple_New(nparam);
+    if (param_types == NULL)
+        goto error;
+
+    ntype = 0;
+    for (i=0; i < nparam; i++) {
+        PyObject *item;
+
+        item = guard_signature_param_types(PySequence_Fast_GET_ITEM(seq, i));
+        if (item == NULL)
+            goto error;
+        PyTuple_SET_ITEM(param_types, i, item);
+        ntype += PyTuple_GET_SIZE(item);
+    }
+    Py_CLEAR(seq);
+
+    size = (size_t)(nparam + 1) * sizeof(type_index[0])
+           + (size_t)ntype * sizeof(types[0]);
+    if (size > (size_t)PY_SSIZE_T_MAX) {
+        PyErr_NoMemory();
+        goto error;
+    }
+
+    garg = PyMem_Malloc(nparam * sizeof(garg[0]));
+    if (garg == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+
+    type_index = PyMem_Malloc(size);
+    if (type_index == NULL) {
+        PyMem_Free(garg);
+        PyErr_NoMemory();
+        goto error;
+    }
+    types = (PyTypeObject **)&type_index[nparam + 1];
+
+    ntype = 0;
+    for (i=0; i < nparam; i++) {
+        PyObject *item = PyTuple_GET_ITEM(param_types, i);
+
+        type_index[i] = ntype;
+        for (j=0; j < PyTuple_GET_SIZE(item); j++) {
+            PyObject *type = PyTuple_GET_ITEM(item, j);
+
+            Py_INCREF(type);
+            types[ntype] = (PyTypeObject *)type;
+            ntype++;
+        }
+    }
+    type_index[nparam] = ntype;
+    Py_DECREF(param_types);
+
+    for (i=0; i < nparam; i++)
+        guard_arg_init(&garg[i], i);
+
+    guard_signature_clear(self);
+    self->nparam = nparam;
+    self->type_index = type_index;
+    self->types = types;
+    self->args = garg;
     return 0;
+
+error:
+    Py_XDECREF(seq);
+    Py_XDECREF(param_types);
+    return -1;
 }
 
-static PyMemberDef guard_func_members[] = {
-    {"func",   T_OBJECT,   offsetof(GuardFuncObject, func),
-     RESTRICTED|READONLY},
-    {"code",   T_OBJECT,   offsetof(GuardFuncObject, code),
-     RESTRICTED|READONLY},
+static PyObject*
+guard_signature_get_arg_types(GuardSignatureObject *self)
+{
+    PyObject *tuple;
+    Py_ssize_t i, j;
+
+    tuple = PyTuple_New(self->nparam);
+    if (tuple == NULL)
+        return NULL;
+
+    for (i=0; i < self->nparam; i++) {
+        Py_ssize_t start = self->type_index[i];
+        Py_ssize_t end = self->type_index[i+1];
+        PyObject *item;
+
+        if (start == end) {
+            Py_INCREF(Py_None);
+            PyTuple_SET_ITEM(tuple, i, Py_None);
+            continue;
+        }
+
+        item = PyTuple_New(end - start);
+        if (item == NULL) {
+            Py_DECREF(tuple);
+            return NULL;
+        }
+        for (j=start; j < end; j++) {
+            PyObject *type = (PyObject *)self->types[j];
+            Py_INCREF(type);
+            PyTuple_SET_ITEM(item, j - start, type);
+        }
+        PyTuple_SET_ITEM(tuple, i, item);
+    }
+    return tuple;
+}
+
+static PyGetSetDef guard_signature_getsetlist[] = {
+    {"arg_types", (getter)guard_signature_get_arg_types},
+    {NULL} /* Sentinel */
+};
+
+static PyMemberDef guard_signature_members[] = {
+    GUARD_MEMBERS
     {NULL}  /* Sentinel */
 };
 
-static PyTypeObject GuardFunc_Type = {
+PyDoc_STRVAR(guard_signature_doc,
+"GuardSignature(arg_types)\n"
+"\n"
+"Guard on the types of the first positional arguments: arg_types[i] are\n"
+"the types of the argument i, a type, an iterable of types or None for\n"
+"any type.\n"
+"\n"
+"Arguments are resolved as GuardArgType(i, arg_types[i]): arguments can\n"
+"be passed by keyword, and the default value of a missing argument is\n"
+"checked.");
+
+static PyTypeObject GuardSignature_Type = {
     PyVarObject_HEAD_INIT(&PyType_Type, 0)
-    "fat.GuardFunc",
-    sizeof(GuardFuncObject),
+    "fat.GuardSignature",
+    sizeof(GuardSignatureObject),
     0,
-    (destructor)guard_func_dealloc,             /* tp_dealloc */
+    (destructor)guard_signature_dealloc,        /* tp_dealloc */
     0,                                          /* tp_print */
     0,                                          /* tp_getattr */
     0,                                          /* tp_setattr */
@@ -369,302 +975,445 @@ static PyTypeObject GuardFunc_Type = {
     0,                                          /* tp_setattro */
     0,                                          /* tp_as_buffer */
     Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
-    0,                                          /* tp_doc */
-    (traverseproc)guard_func_traverse,          /* tp_traverse */
+    guard_signature_doc,                        /* tp_doc */
+    (traverseproc)guard_signature_traverse,     /* tp_traverse */
     0,                                          /* tp_clear */
     0,                                          /* tp_richcompare */
     0,                                          /* tp_weaklistoffset */
     0,                                          /* tp_iter */
     0,                                          /* tp_iternext */
     0,                                          /* tp_methods */
-    guard_func_members,                         /* tp_members */
-    0,                                          /* tp_getset */
-    &PyFuncGuard_Type,                      /* tp_base */
+    guard_signature_members,                    /* tp_members */
+    guard_signature_getsetlist,                 /* tp_getset */
+    &PyFuncGuard_Type,                          /* tp_base */
     0,                                          /* tp_dict */
     0,                                          /* tp_descr_get */
     0,                                          /* tp_descr_set */
     0,                                          /* tp_dictoffset */
-    guard_func_init,                            /* tp_init */
+    guard_signature_init,                       /* tp_init */
     0,                                          /* tp_alloc */
-    guard_func_new,                             /* tp_new */
+    guard_signature_new,                        /* tp_new */
     0,                                          /* tp_free */
 };
 
 
-/* GuardDict */
+/* GuardTypeDispatch */
 
-typedef struct {
-    PyObject *key;
-    PyObject *value;
-} GuardDictPair;
+/* maximum number of dispatched arguments */
+#define DISPATCH_MAX_ARGS 8
+/* number of entries of the move-to-front cache */
+#define DISPATCH_CACHE_SIZE 8
 
 typedef struct {
-    PyFuncGuardObject base;
-    PyObject *dict;
-    PY_UINT64_T dict_version;
-    Py_ssize_t npair;
-    GuardDictPair *pairs;
-} GuardDictObject;
+    GuardObject base;
+    Py_ssize_t narg;
+    Py_ssize_t arg_indexes[DISPATCH_MAX_ARGS];
+    /* (type1, type2, ...) => target */
+    PyObject *table;
+    PyObject *fallback;
+    /* most recently used entries of table: the types of the entry i are
+       cache_types[i*narg:(i+1)*narg] (strong references, the types of the
+       arguments can differ from the types of the table key if a metaclass
+       overrides __eq__), targets are borrowed references */
+    Py_ssize_t ncache;
+    PyObject *cache_targets[DISPATCH_CACHE_SIZE];
+    PyTypeObject **cache_types;
+} GuardTypeDispatchObject;
 
 static void
-guard_dict_pair_dealloc(GuardDictPair *pair)
+type_dispatch_cache_clear(GuardTypeDispatchObject *guard)
 {
-    Py_CLEAR(pair->key);
-    Py_CLEAR(pair->value);
+    Py_ssize_t ncache = guard->ncache;
+    Py_ssize_t i;
+
+    guard->ncache = 0;
+    for (i=0; i < ncache * guard->narg; i++)
+        Py_DECREF(guard->cache_types[i]);
 }
 
+/* Move the entry index of the cache to the front. If index is ncache, add
+   a new entry: the least recently used entry is evicted if the cache is
+   full. */
 static void
-guard_dict_clear(GuardDictObject *guard)
+type_dispatch_cache_insert(GuardTypeDispatchObject *guard, Py_ssize_t index,
+                           PyTypeObject **types, PyObject *target)
 {
+    PyTypeObject *evicted[DISPATCH_MAX_ARGS];
+    Py_ssize_t narg = guard->narg;
+    Py_ssize_t nevicted = 0;
     Py_ssize_t i;
 
-    Py_CLEAR(guard->dict);
-    for (i=0; i < guard->npair; i++)
-        guard_dict_pair_dealloc(&guard->pairs[i]);
-    guard->npair = 0;
-    PyMem_Free(guard->pairs);
-    guard->pairs = NULL;
+    if (index == guard->ncache) {
+        for (i=0; i < narg; i++)
+            Py_INCREF(types[i]);
+
+        if (guard->ncache < DISPATCH_CACHE_SIZE) {
+            guard->ncache++;
+        }
+        else {
+            index = DISPATCH_CACHE_SIZE - 1;
+            memcpy(evicted, &guard->cache_types[index * narg],
+                   narg * sizeof(evicted[0]));
+            nevicted = narg;
+        }
+    }
+
+    /* move entries 0..index-1 after the first entry */
+    memmove(&guard->cache_types[narg], &guard->cache_types[0],
+            index * narg * sizeof(guard->cache_types[0]));
+    memmove(&guard->cache_targets[1], &guard->cache_targets[0],
+            index * sizeof(guard->cache_targets[0]));
+
+    memcpy(&guard->cache_types[0], types, narg * sizeof(types[0]));
+    guard->cache_targets[0] = target;
+
+    /* the cache is consistent: the evicted types can now be destroyed */
+    for (i=0; i < nevicted; i++)
+        Py_DECREF(evicted[i]);
 }
 
+/* Find the target for the types of the arguments: return 1 and set
+   *ptarget to a borrowed reference, return 0 if no target was registered
+   for these types, or return -1 on error. */
 static int
-check_dict_pair_guard(PyObject *dict, GuardDictPair *pair)
+type_dispatch_lookup(GuardTypeDispatchObject *guard, PyObject **stack, Py_ssize_t nargs,
+                     PyObject **ptarget)
 {
-    PyObject *current_value;
+    PyTypeObject *types[DISPATCH_MAX_ARGS];
+    Py_ssize_t narg = guard->narg;
+    Py_ssize_t i, j;
+    PyObject *key, *target;
+
+    for (i=0; i < narg; i++) {
+        Py_ssize_t index = guard->arg_indexes[i];
+        if (index >= nargs)
+            return 0;
+        types[i] = Py_TYPE(stack[index]);
+    }
 
-    /* FIXME: Use PyDict_GetItem? */
-    current_value = PyObject_GetItem(dict, pair->key);
-    if (current_value == NULL && PyErr_Occurred()) {
-        if (!PyErr_ExceptionMatches(PyExc_KeyError)) {
-            /* lookup faileds */
-            return -1;
+    for (i=0; i < guard->ncache; i++) {
+        PyTypeObject **entry = &guard->cache_types[i * narg];
+
+        for (j=0; j < narg; j++) {
+            if (entry[j] != types[j])
+                break;
+        }
+        if (j == narg) {
+            target = guard->cache_targets[i];
+            if (i != 0)
+                type_dispatch_cache_insert(guard, i, types, target);
+            *ptarget = target;
+            return 1;
         }
-        /* key doesn't exist */
-        PyErr_Clear();
     }
 
-    /* we only care of the value pointer, not its content,
-       so it is safe to use the pointer after Py_DECREF */
-    Py_XDECREF(current_value);
-
-    if (current_value == pair->value) {
-        /* another key was modified, but the watched key is unchanged */
+    /* cache miss: lookup into the table */
+    key = PyTuple_New(narg);
+    if (key == NULL)
+        return -1;
+    for (i=0; i < narg; i++) {
+        Py_INCREF(types[i]);
+        PyTuple_SET_ITEM(key, i, (PyObject *)types[i]);
+    }
+    target = PyDict_GetItemWithError(guard->table, key);
+    Py_DECREF(key);
+    if (target == NULL) {
+        if (PyErr_Occurred())
+            return -1;
         return 0;
     }
 
-    /* the key was modified (removed or new value) */
-    return 2;
+    type_dispatch_cache_insert(guard, guard->ncache, types, target);
+    *ptarget = target;
+    return 1;
 }
 
 static int
-guard_dict_check(PyObject *self, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
+guard_type_dispatch_check(PyObject *self, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
 {
-    GuardDictObject *guard = (GuardDictObject *)self;
-    PY_UINT64_T dict_version;
-    PyObject *dict;
-    Py_ssize_t i;
+    GuardTypeDispatchObject *guard = (GuardTypeDispatchObject *)self;
+    PyObject *target;
+    int res;
+
+    res = type_dispatch_lookup(guard, stack, nargs, &target);
+    if (res < 0)
+        return -1;
+    /* no registered target: use the generic code */
+    return guard_count_check(&guard->base, res ? 0 : 1);
+}
 
-    dict = guard->dict;
-    assert(PyDict_Check(dict));
+static PyObject *
+guard_type_dispatch_call(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    GuardTypeDispatchObject *guard = (GuardTypeDispatchObject *)self;
+    PyObject *target, *result;
+    int res;
 
-    dict_version = (((PyDictObject*)(dict))->ma_version_tag);
-    if (unlikely(dict_version != guard->dict_version)) {
-        assert(guard->npair >= 1);
+    res = type_dispatch_lookup(guard,
+                               &PyTuple_GET_ITEM(args, 0), PyTuple_GET_SIZE(args),
+                               &target);
+    if (res < 0)
+        return NULL;
 
-        for (i=0; i < guard->npair; i++) {
-            int res = check_dict_pair_guard(dict, &guard->pairs[i]);
-            if (res)
-                return res;
+    if (res == 0) {
+        if (guard->fallback == NULL || guard->fallback == Py_None) {
+            PyErr_SetString(PyExc_TypeError,
+                            "no target registered for the argument types");
+            return NULL;
         }
-
-        guard->dict_version = dict_version;
+        target = guard->fallback;
     }
 
-    return 0;
+    /* the target can call register() or __init__() which replaces it
+       in the table or the fallback */
+    Py_INCREF(target);
+    result = PyObject_Call(target, args, kwargs);
+    Py_DECREF(target);
+    return result;
 }
 
 static void
-guard_dict_dealloc(GuardDictObject *self)
+guard_type_dispatch_dealloc(GuardTypeDispatchObject *self)
 {
-    guard_dict_clear(self);
+    type_dispatch_cache_clear(self);
+    Py_CLEAR(self->table);
+    Py_CLEAR(self->fallback);
+    PyMem_Free(self->cache_types);
 
     PyFuncGuard_Type.tp_dealloc((PyObject *)self);
 }
 
 static int
-guard_dict_traverse(GuardDictObject *guard, visitproc visit, void *arg)
+guard_type_dispatch_traverse(GuardTypeDispatchObject *self, visitproc visit, void *arg)
 {
     Py_ssize_t i;
 
-    Py_VISIT(guard->dict);
-    for (i=0; i < guard->npair; i++) {
-        Py_VISIT(guard->pairs[i].key);
-        Py_VISIT(guard->pairs[i].value);
-    }
+    Py_VISIT(self->table);
+    Py_VISIT(self->fallback);
+    for (i=0; i < self->ncache * self->narg; i++)
+        Py_VISIT(self->cache_types[i]);
     return 0;
 }
 
 static PyObject *
-guard_dict_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+guard_type_dispatch_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
     PyObject *op;
-    GuardDictObject *self;
+    GuardTypeDispatchObject *self;
 
     op = PyFuncGuard_Type.tp_new(type, args, kwds);
     if (op == NULL)
         return NULL;
 
-    self = (GuardDictObject *)op;
-    self->base.check = guard_dict_check;
-    self->dict = NULL;
-    self->dict_version = 0;
-    self->npair = 0;
-    self->pairs = NULL;
+    self = (GuardTypeDispatchObject *)op;
+    self->base.base.check = guard_type_dispatch_check;
+    self->narg = 0;
+    self->table = NULL;
+    self->fallback = NULL;
+    self->ncache = 0;
+    self->cache_types = NULL;
+
     return op;
 }
 
 static int
-guard_dict_init_keys(PyObject *op, PyObject *dict,
-                     Py_ssize_t first_key, PyObject *keys)
+guard_type_dispatch_init(PyObject *op, PyObject *args, PyObject *kwargs)
 {
-    GuardDictObject *self = (GuardDictObject *)op;
-    GuardDictPair *pairs = NULL;
-    Py_ssize_t nkeys, i, npair = 0;
+    GuardTypeDispatchObject *self = (GuardTypeDispatchObject *)op;
+    static char *keywords[] = {"arg_indexes", "fallback", NULL};
+    PyObject *arg_indexes_obj, *fallback = Py_None;
+    PyObject *seq, *table;
+    PyTypeObject **cache_types;
+    Py_ssize_t narg, i;
+    Py_ssize_t arg_indexes[DISPATCH_MAX_ARGS];
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O:GuardTypeDispatch", keywords,
+                                     &arg_indexes_obj, &fallback))
+        return -1;
 
-    /* FIXME: PyDict_CheckExact(dict)? */
+    seq = PySequence_Fast(arg_indexes_obj, "arg_indexes must be an iterable");
+    if (seq == NULL)
+        return -1;
 
-    if (!PyTuple_Check(keys)) {
-        PyErr_Format(PyExc_TypeError,
-                     "keys must be a tuple of str, not %s",
-                     Py_TYPE(keys)->tp_name);
-        goto error;
+    narg = PySequence_Fast_GET_SIZE(seq);
+    if (narg == 0 || narg > DISPATCH_MAX_ARGS) {
+        PyErr_Format(PyExc_ValueError,
+                     "need between 1 and %i argument indexes",
+                     DISPATCH_MAX_ARGS);
+        Py_DECREF(seq);
+        return -1;
     }
 
-    nkeys = PyTuple_GET_SIZE(keys);
-    if ((nkeys - first_key) <= 0) {
-        PyErr_SetString(PyExc_TypeError,
-                        "keys must at least contain one key");
-        goto error;
+    for (i=0; i < narg; i++) {
+        Py_ssize_t index = PyNumber_AsSsize_t(PySequence_Fast_GET_ITEM(seq, i),
+                                              PyExc_OverflowError);
+        if (index == -1 && PyErr_Occurred()) {
+            Py_DECREF(seq);
+            return -1;
+        }
+        if (index < 0) {
+            PyErr_SetString(PyExc_ValueError,
+                            "argument index must be positive");
+            Py_DECREF(seq);
+            return -1;
+        }
+        arg_indexes[i] = index;
     }
+    Py_DECREF(seq);
 
-    if (nkeys >  PY_SSIZE_T_MAX / (Py_ssize_t)sizeof(GuardDictPair)) {
-        PyErr_NoMemory();
-        goto error;
+    if (fallback != Py_None && !PyCallable_Check(fallback)) {
+        PyErr_Format(PyExc_TypeError,
+                     "fallback must be callable, got %s",
+                     Py_TYPE(fallback)->tp_name);
+        return -1;
     }
-    pairs = PyMem_Malloc(sizeof(GuardDictPair) * nkeys);
-    if (pairs == NULL) {
+
+    cache_types = PyMem_Malloc(DISPATCH_CACHE_SIZE * narg * sizeof(cache_types[0]));
+    if (cache_types == NULL) {
         PyErr_NoMemory();
-        goto error;
+        return -1;
     }
 
-    for (i=first_key; i < nkeys; i++) {
-        PyObject *key, *value;
-
-        key = PyTuple_GET_ITEM(keys, i);
-
-        if (!PyUnicode_Check(key)) {
-            PyErr_Format(PyExc_TypeError,
-                         "key must be str, not %s",
-                         Py_TYPE(key)->tp_name);
-            goto error;
-        }
-
-        /* Intern the key string */
-        Py_INCREF(key);
-        PyUnicode_InternInPlace(&key);
-
-        value = PyObject_GetItem(dict, key);
-        if (value == NULL && PyErr_Occurred()) {
-            if (!PyErr_ExceptionMatches(PyExc_KeyError)) {
-                Py_DECREF(key);
-                goto error;
-            }
-            /* key doesn't exist */
-            PyErr_Clear();
-        }
-
-        pairs[npair].key = key;
-        pairs[npair].value = value;
-        npair++;
+    table = PyDict_New();
+    if (table == NULL) {
+        PyMem_Free(cache_types);
+        return -1;
     }
 
-    guard_dict_clear(self);
-
-    Py_INCREF(dict);
-    self->dict = dict;
-    self->dict_version = (((PyDictObject*)(dict))->ma_version_tag);
-    self->npair = npair;
-    self->pairs = pairs;
+    type_dispatch_cache_clear(self);
+    self->narg = narg;
+    memcpy(self->arg_indexes, arg_indexes, narg * sizeof(arg_indexes[0]));
+    Py_XSETREF(self->table, table);
+    Py_INCREF(fallback);
+    Py_XSETREF(self->fallback, fallback);
+    PyMem_Free(self->cache_types);
+    self->cache_types = cache_types;
     return 0;
-
-error:
-    for (i=0; i < npair; i++)
-        guard_dict_pair_dealloc(&pairs[i]);
-    PyMem_Free(pairs);
-    return -1;
 }
 
-static int
-guard_dict_init(PyObject *op, PyObject *args, PyObject *kwargs)
+static PyObject *
+guard_type_dispatch_register(GuardTypeDispatchObject *self, PyObject *args)
 {
-    PyObject *dict;
+    PyObject *types, *target, *key;
+    Py_ssize_t i;
+    int res;
 
-    if (kwargs) {
-        PyErr_SetString(PyExc_TypeError,
-                        "keyword arguments are not supported");
-        return -1;
+    if (!PyArg_ParseTuple(args, "OO:register", &types, &target))
+        return NULL;
+
+    if (self->table == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "guard is not initialized");
+        return NULL;
     }
-    assert(PyTuple_Check(args));
-    if (PyTuple_GET_SIZE(args) == 0) {
-        PyErr_SetString(PyExc_TypeError, "missing dict parameter");
-        return -1;
+
+    if (PyType_Check(types))
+        key = PyTuple_Pack(1, types);
+    else
+        key = PySequence_Tuple(types);
+    if (key == NULL)
+        return NULL;
+
+    if (PyTuple_GET_SIZE(key) != self->narg) {
+        PyErr_Format(PyExc_ValueError,
+                     "expected %zd types, got %zd",
+                     self->narg, PyTuple_GET_SIZE(key));
+        Py_DECREF(key);
+        return NULL;
+    }
+    for (i=0; i < self->narg; i++) {
+        PyObject *type = PyTuple_GET_ITEM(key, i);
+        if (!PyType_Check(type)) {
+            PyErr_Format(PyExc_TypeError,
+                         "arg_type must be a type, got %s",
+                         Py_TYPE(type)->tp_name);
+            Py_DECREF(key);
+            return NULL;
+        }
     }
-    dict = PyTuple_GET_ITEM(args, 0);
-    if (!PyDict_Check(dict)) {
+
+    if (!PyCallable_Check(target)) {
         PyErr_Format(PyExc_TypeError,
-                     "dict parameter must be dict, got %s",
-                     Py_TYPE(dict)->tp_name);
-        return -1;
+                     "target must be callable, got %s",
+                     Py_TYPE(target)->tp_name);
+        Py_DECREF(key);
+        return NULL;
     }
 
-    return guard_dict_init_keys(op, dict, 1, args);
+    res = PyDict_SetItem(self->table, key, target);
+    Py_DECREF(key);
+    if (res < 0)
+        return NULL;
+
+    /* the cache uses borrowed references to targets */
+    type_dispatch_cache_clear(self);
+    Py_RETURN_NONE;
 }
 
 static PyObject*
-guard_dict_get_keys(GuardDictObject *self)
+guard_type_dispatch_get_arg_indexes(GuardTypeDispatchObject *self)
 {
     PyObject *tuple;
     Py_ssize_t i;
 
-    tuple = PyTuple_New(self->npair);
+    tuple = PyTuple_New(self->narg);
     if (tuple == NULL)
         return NULL;
 
-    for (i=0; i < self->npair; i++) {
-        GuardDictPair *pair = &self->pairs[i];
-
-        Py_INCREF(pair->key);
-        PyTuple_SET_ITEM(tuple, i, pair->key);
+    for (i=0; i < self->narg; i++) {
+        PyObject *index = PyLong_FromSsize_t(self->arg_indexes[i]);
+        if (index == NULL) {
+            Py_DECREF(tuple);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(tuple, i, index);
     }
     return tuple;
 }
 
-static PyGetSetDef guard_dict_getsetlist[] = {
-    {"keys", (getter)guard_dict_get_keys},
+static PyObject*
+guard_type_dispatch_get_table(GuardTypeDispatchObject *self)
+{
+    if (self->table == NULL)
+        return PyDict_New();
+    return PyDict_Copy(self->table);
+}
+
+static PyMethodDef guard_type_dispatch_methods[] = {
+    {"register", (PyCFunction)guard_type_dispatch_register, METH_VARARGS,
+     "register(types, target): call target if arguments have these types"},
+    {NULL, NULL}  /* Sentinel */
+};
+
+static PyGetSetDef guard_type_dispatch_getsetlist[] = {
+    {"arg_indexes", (getter)guard_type_dispatch_get_arg_indexes},
+    {"table", (getter)guard_type_dispatch_get_table},
     {NULL} /* Sentinel */
 };
 
-static PyMemberDef guard_dict_members[] = {
-    {"dict",   T_OBJECT,   offsetof(GuardDictObject, dict),
+static PyMemberDef guard_type_dispatch_members[] = {
+    {"fallback",   T_OBJECT,   offsetof(GuardTypeDispatchObject, fallback),
      RESTRICTED|READONLY},
+    GUARD_MEMBERS
     {NULL}  /* Sentinel */
 };
 
-static PyTypeObject GuardDict_Type = {
-    PyVarObject_HEAD_INIT(&PyType_Type, 0)
-    "fat.GuardDict",
-    sizeof(GuardDictObject),
+PyDoc_STRVAR(guard_type_dispatch_doc,
+"GuardTypeDispatch(arg_indexes, fallback=None)\n"
+"\n"
+"Polymorphic inline cache: dispatch a call to the target registered for\n"
+"the types of the positional arguments arg_indexes.\n"
+"\n"
+"The object is both the guard and the specialized code:\n"
+"fat.specialize(func, guard, [guard]). The guard fails if no target was\n"
+"registered for the argument types. Calling the guard calls the target,\n"
+"or fallback if no target was registered.");
+
+static PyTypeObject GuardTypeDispatch_Type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "fat.GuardTypeDispatch",
+    sizeof(GuardTypeDispatchObject),
     0,
-    (destructor)guard_dict_dealloc,             /* tp_dealloc */
+    (destructor)guard_type_dispatch_dealloc,    /* tp_dealloc */
     0,                                          /* tp_print */
     0,                                          /* tp_getattr */
     0,                                          /* tp_setattr */
@@ -674,107 +1423,222 @@ static PyTypeObject GuardDict_Type = {
     0,                                          /* tp_as_sequence */
     0,                                          /* tp_as_mapping */
     0,                                          /* tp_hash */
-    0,                                          /* tp_call */
+    guard_type_dispatch_call,                   /* tp_call */
     0,                                          /* tp_str */
     0,                                          /* tp_getattro */
     0,                                          /* tp_setattro */
     0,                                          /* tp_as_buffer */
     Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
-    0,                                          /* tp_doc */
-    (traverseproc)guard_dict_traverse,          /* tp_traverse */
+    guard_type_dispatch_doc,                    /* tp_doc */
+    (traverseproc)guard_type_dispatch_traverse, /* tp_traverse */
     0,                                          /* tp_clear */
     0,                                          /* tp_richcompare */
     0,                                          /* tp_weaklistoffset */
     0,                                          /* tp_iter */
     0,                                          /* tp_iternext */
-    0,                                          /* tp_methods */
-    guard_dict_members,                         /* tp_members */
-    guard_dict_getsetlist,                      /* tp_getset */
+    guard_type_dispatch_methods,                /* tp_methods */
+    guard_type_dispatch_members,                /* tp_members */
+    guard_type_dispatch_getsetlist,             /* tp_getset */
     &PyFuncGuard_Type,                          /* tp_base */
     0,                                          /* tp_dict */
     0,                                          /* tp_descr_get */
     0,                                          /* tp_descr_set */
     0,                                          /* tp_dictoffset */
-    guard_dict_init,                            /* tp_init */
+    guard_type_dispatch_init,                   /* tp_init */
     0,                                          /* tp_alloc */
-    guard_dict_new,                             /* tp_new */
+    guard_type_dispatch_new,                    /* tp_new */
     0,                                          /* tp_free */
 };
 
 
-/* GuardGlobals */
+/* GuardArgValue */
 
+typedef struct {
+    GuardObject base;
+    GuardArg arg;
+    /* tuple of accepted values */
+    PyObject *values;
+    /* 1 if a value is compared by value, not only by identity */
+    int compare_values;
+} GuardArgValueObject;
+
+/* Immutable builtin types compared by value: exact types only, so the
+   comparison cannot execute arbitrary code */
 static int
-guard_globals_check(PyObject *self, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
+is_value_type(PyTypeObject *type)
 {
-    GuardDictObject *guard = (GuardDictObject *)self;
-    PyThreadState *tstate;
-    PyFrameObject *frame;
+    return (type == &PyLong_Type
+            || type == &PyFloat_Type
+            || type == &PyComplex_Type
+            || type == &PyUnicode_Type
+            || type == &PyBytes_Type);
+}
 
-    tstate = PyThreadState_GET();
-    assert(tstate != NULL);
+/* Compare two objects of the same value type. Floats are compared by their
+   representation: 0.0 and -0.0 are different, a NaN is equal to itself. */
+static int
+value_type_equal(PyObject *a, PyObject *b)
+{
+    PyTypeObject *type = Py_TYPE(a);
 
-    frame = tstate->frame;
-    assert(frame != NULL);
+    assert(Py_TYPE(b) == type);
+    if (type == &PyFloat_Type) {
+        double x = PyFloat_AS_DOUBLE(a), y = PyFloat_AS_DOUBLE(b);
+        return (memcmp(&x, &y, sizeof(double)) == 0);
+    }
+    if (type == &PyComplex_Type) {
+        Py_complex x = ((PyComplexObject *)a)->cval;
+        Py_complex y = ((PyComplexObject *)b)->cval;
+        return (memcmp(&x.real, &y.real, sizeof(double)) == 0
+                && memcmp(&x.imag, &y.imag, sizeof(double)) == 0);
+    }
+    /* int, str and bytes: comparison cannot fail */
+    return PyObject_RichCompareBool(a, b, Py_EQ);
+}
 
-    /* If the frame globals dictionary is different than the frame globals
-     * dictionary used to create the guard, the guard check fails */
-    if (unlikely(frame->f_globals != guard->dict))
-        return 2;
+static int
+guard_arg_value_init_guard(PyObject *self, PyObject *func)
+{
+    GuardArgValueObject *guard = (GuardArgValueObject *)self;
+
+    return guard_arg_bind(&guard->arg, func);
+}
+
+static int
+check_arg_value_guard(GuardArgValueObject *guard, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *arg;
+    Py_ssize_t i, nvalue;
+
+    if (guard_arg_get(&guard->arg, stack, nargs, kwnames, &arg))
+        return 1;
+
+    nvalue = PyTuple_GET_SIZE(guard->values);
+    for (i=0; i < nvalue; i++) {
+        if (PyTuple_GET_ITEM(guard->values, i) == arg)
+            return 0;
+    }
+
+    if (!guard->compare_values || !is_value_type(Py_TYPE(arg)))
+        return 1;
 
-    return guard_dict_check(self, stack, nargs, kwnames);
+    for (i=0; i < nvalue; i++) {
+        PyObject *value = PyTuple_GET_ITEM(guard->values, i);
+
+        if (Py_TYPE(value) == Py_TYPE(arg) && value_type_equal(value, arg))
+            return 0;
+    }
+    return 1;
+}
+
+static int
+guard_arg_value_check(PyObject *self, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
+{
+    GuardArgValueObject *guard = (GuardArgValueObject *)self;
+
+    return guard_count_check(&guard->base,
+                             check_arg_value_guard(guard, stack, nargs, kwnames));
+}
+
+static void
+guard_arg_value_dealloc(GuardArgValueObject *self)
+{
+    Py_XDECREF(self->values);
+    guard_arg_clear(&self->arg);
+
+    PyFuncGuard_Type.tp_dealloc((PyObject *)self);
+}
+
+static int
+guard_arg_value_traverse(GuardArgValueObject *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->values);
+    return guard_arg_traverse(&self->arg, visit, arg);
 }
 
 static PyObject *
-guard_globals_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+guard_arg_value_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
     PyObject *op;
-    GuardDictObject *self;
+    GuardArgValueObject *self;
 
-    op = GuardDict_Type.tp_new(type, args, kwds);
+    op = PyFuncGuard_Type.tp_new(type, args, kwds);
     if (op == NULL)
         return NULL;
 
-    self = (GuardDictObject *)op;
-    self->base.check = guard_globals_check;
+    self = (GuardArgValueObject *)op;
+    self->base.base.init = guard_arg_value_init_guard;
+    self->base.base.check = guard_arg_value_check;
+    guard_arg_init(&self->arg, 0);
+    self->values = NULL;
+    self->compare_values = 0;
 
     return op;
 }
 
 static int
-guard_globals_init(PyObject *op, PyObject *args, PyObject *kwargs)
+guard_arg_value_init(PyObject *op, PyObject *args, PyObject *kwargs)
 {
-    PyObject *globals, *keys;
+    GuardArgValueObject *self = (GuardArgValueObject *)op;
+    static char *keywords[] = {"arg_index", "values", NULL};
+    int arg_index;
+    PyObject *values_obj, *values;
+    int compare_values = 0;
+    Py_ssize_t i;
 
-    if (kwargs) {
-        PyErr_SetString(PyExc_TypeError,
-                        "keyword arguments are not supported");
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "iO:GuardArgValue", keywords,
+                                     &arg_index, &values_obj))
+        return -1;
+    if (guard_arg_check_index(arg_index) < 0)
         return -1;
-    }
-    keys = args;
 
-    globals = PyEval_GetGlobals();
-    if (globals == NULL) {
-        PyErr_SetString(PyExc_RuntimeError,
-                        "unable to get globals");
+    values = PySequence_Tuple(values_obj);
+    if (values == NULL)
         return -1;
+
+    if (PyTuple_GET_SIZE(values) == 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "need at least one value");
+        Py_DECREF(values);
+        return -1;
+    }
+
+    for (i=0; i < PyTuple_GET_SIZE(values); i++) {
+        if (is_value_type(Py_TYPE(PyTuple_GET_ITEM(values, i))))
+            compare_values = 1;
     }
 
-    return guard_dict_init_keys(op, globals, 0, keys);
+    Py_XSETREF(self->values, values);
+    guard_arg_reset(&self->arg, arg_index);
+    self->compare_values = compare_values;
+    return 0;
 }
 
+static PyMemberDef guard_arg_value_members[] = {
+    {"arg_index",   T_PYSSIZET,   offsetof(GuardArgValueObject, arg.arg_index),
+     RESTRICTED|READONLY},
+    {"arg_name",   T_OBJECT,   offsetof(GuardArgValueObject, arg.name),
+     RESTRICTED|READONLY},
+    {"values",   T_OBJECT,   offsetof(GuardArgValueObject, values),
+     RESTRICTED|READONLY},
+    GUARD_MEMBERS
+    {NULL}  /* Sentinel */
+};
 
-PyDoc_STRVAR(guard_globals_doc,
-"GuardGlobals(keys)\n"
+PyDoc_STRVAR(guard_arg_value_doc,
+"GuardArgValue(arg_index, values)\n"
 "\n"
-"Guard on globals()[key] for all keys.");
+"Guard on the value of a function argument: the argument must be one of\n"
+"values. Objects are compared by identity, except of int, float, complex,\n"
+"str and bytes (exact types) which are compared by value. Floats are\n"
+"compared by their representation: 0.0 doesn't match -0.0.");
 
-static PyTypeObject GuardGlobals_Type = {
+static PyTypeObject GuardArgValue_Type = {
     PyVarObject_HEAD_INIT(&PyType_Type, 0)
-    "fat.GuardGlobals",
-    sizeof(GuardDictObject),
+    "fat.GuardArgValue",
+    sizeof(GuardArgValueObject),
     0,
-    0,                                          /* tp_dealloc */
+    (destructor)guard_arg_value_dealloc,        /* tp_dealloc */
     0,                                          /* tp_print */
     0,                                          /* tp_getattr */
     0,                                          /* tp_setattr */
@@ -790,396 +1654,4778 @@ static PyTypeObject GuardGlobals_Type = {
     0,                                          /* tp_setattro */
     0,                                          /* tp_as_buffer */
     Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
-    guard_globals_doc,                          /* tp_doc */
-    (traverseproc)guard_dict_traverse,          /* tp_traverse */
+    guard_arg_value_doc,                        /* tp_doc */
+    (traverseproc)guard_arg_value_traverse,     /* tp_traverse */
     0,                                          /* tp_clear */
     0,                                          /* tp_richcompare */
     0,                                          /* tp_weaklistoffset */
     0,                                          /* tp_iter */
     0,                                          /* tp_iternext */
     0,                                          /* tp_methods */
-    0,                                          /* tp_members */
+    guard_arg_value_members,                    /* tp_members */
     0,                                          /* tp_getset */
-    &GuardDict_Type,                            /* tp_base */
+    &PyFuncGuard_Type,                          /* tp_base */
     0,                                          /* tp_dict */
     0,                                          /* tp_descr_get */
     0,                                          /* tp_descr_set */
     0,                                          /* tp_dictoffset */
-    guard_globals_init,                        /* tp_init */
+    guard_arg_value_init,                       /* tp_init */
     0,                                          /* tp_alloc */
-    guard_globals_new,                         /* tp_new */
+    guard_arg_value_new,                        /* tp_new */
     0,                                          /* tp_free */
 };
 
 
-/* GuardBuiltins */
+/* GuardArgRange */
+
+/* maximum number of digits of an int fitting in a long long */
+#define LLONG_MAX_DIGITS \
+    ((int)((sizeof(long long) * 8 + PyLong_SHIFT - 1) / PyLong_SHIFT))
 
 typedef struct {
-    GuardDictObject base;
-    int init_failed;
-    PyObject *guard_globals;
-} GuardBuiltinsObject;
+    GuardObject base;
+    GuardArg arg;
+    long long min;
+    long long max;
+} GuardArgRangeObject;
 
-static void
-guard_builtins_dealloc(GuardBuiltinsObject *self)
+static int
+guard_arg_range_init_guard(PyObject *self, PyObject *func)
 {
-    Py_CLEAR(self->guard_globals);
-    guard_dict_dealloc(&self->base);
+    GuardArgRangeObject *guard = (GuardArgRangeObject *)self;
+
+    return guard_arg_bind(&guard->arg, func);
 }
 
 static int
-guard_builtins_init_guard(PyObject *self, PyObject *func)
+check_arg_range_guard(GuardArgRangeObject *guard, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
 {
-    GuardBuiltinsObject *guard = (GuardBuiltinsObject *)self;
-    Py_ssize_t i;
-    PyObject *init_value;
-    GuardDictObject *globals_guard;
+    PyObject *arg;
+    Py_ssize_t size;
+    long long value;
+    int overflow;
 
-    assert(init_builtins != NULL);
-    for (i=0; i < guard->base.npair; i++) {
-        PyObject *name = guard->base.pairs[i].key;
+    if (guard_arg_get(&guard->arg, stack, nargs, kwnames, &arg))
+        return 1;
 
-        init_value = PyDict_GetItem(init_builtins, name);
-        if (init_value != NULL) {
-            if (guard->base.pairs[i].value != init_value) {
-                /* builtin was modified since Python initialization:
-                   don't specialize the function */
-                guard->init_failed = 1;
-                return 1;
-            }
-        }
-        PyErr_Clear();
+    if (PyFloat_CheckExact(arg)) {
+        if (!Py_IS_FINITE(PyFloat_AS_DOUBLE(arg)))
+            return 1;
+        return 0;
     }
 
-    globals_guard = (GuardDictObject *)guard->guard_globals;
-    for (i=0; i < globals_guard->npair; i++) {
-        if (globals_guard->pairs[i].value != NULL) {
-            /* if name already exists in global, the guard must fail */
-            guard->init_failed = 1;
+    if (!PyLong_CheckExact(arg))
+        return 1;
+
+    size = Py_SIZE(arg);
+    if (likely(-1 <= size && size <= 1)) {
+        /* 0 or a single digit */
+        value = (long long)size * ((PyLongObject *)arg)->ob_digit[0];
+    }
+    else {
+        /* the number of digits is enough to reject most large ints */
+        if (Py_ABS(size) > LLONG_MAX_DIGITS)
             return 1;
-        }
+
+        value = PyLong_AsLongLongAndOverflow(arg, &overflow);
+        if (overflow)
+            return 1;
+        if (value == -1 && PyErr_Occurred())
+            return -1;
     }
 
-    guard->init_failed = 0;
+    if (value < guard->min || value > guard->max)
+        return 1;
     return 0;
 }
 
 static int
-guard_builtins_check(PyObject *self, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
+guard_arg_range_check(PyObject *self, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
 {
-    GuardBuiltinsObject *guard = (GuardBuiltinsObject *)self;
-    GuardDictObject *guard_globals = (GuardDictObject *)guard->guard_globals;
-    PyThreadState* tstate;
-    PyFrameObject *frame;
-    int res;
-
-    if (unlikely(guard->init_failed == -1)) {
-        guard_builtins_init_guard(self, NULL);
-        assert(guard->init_failed != -1);
-    }
+    GuardArgRangeObject *guard = (GuardArgRangeObject *)self;
 
-    if (unlikely(guard->init_failed))
-        return 2;
-
-    tstate = PyThreadState_GET();
-    assert(tstate != NULL);
-
-    frame = tstate->frame;
-    if (frame == NULL) {
-        /* Python is probably being finalized */
-        return 2;
-    }
-
-    /* If the frame globals dictionary is different than the frame globals
-     * dictionary used to create the guard, the guard check fails */
-    if (unlikely(frame->f_globals != guard_globals->dict)) {
-        return 2;
-    }
+    return guard_count_check(&guard->base,
+                             check_arg_range_guard(guard, stack, nargs, kwnames));
+}
 
-    /* If the builtin dictionary of the current frame is different than the
-     * builtin dictionary used to create the guard, the guard check fails */
-    if (unlikely(frame->f_builtins != guard->base.dict)) {
-        return 2;
-    }
+static void
+guard_arg_range_dealloc(GuardArgRangeObject *self)
+{
+    guard_arg_clear(&self->arg);
 
-    res = guard_dict_check(guard->guard_globals, stack, nargs, kwnames);
-    if (unlikely(res)) {
-        return res;
-    }
+    PyFuncGuard_Type.tp_dealloc((PyObject *)self);
+}
 
-    return guard_dict_check(self, stack, nargs, kwnames);
+static int
+guard_arg_range_traverse(GuardArgRangeObject *self, visitproc visit, void *arg)
+{
+    return guard_arg_traverse(&self->arg, visit, arg);
 }
 
 static PyObject *
-guard_builtins_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+guard_arg_range_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
     PyObject *op;
-    GuardBuiltinsObject *self;
+    GuardArgRangeObject *self;
 
-    op = GuardDict_Type.tp_new(type, args, kwds);
+    op = PyFuncGuard_Type.tp_new(type, args, kwds);
     if (op == NULL)
         return NULL;
 
-    self = (GuardBuiltinsObject *)op;
-    self->base.base.init = guard_builtins_init_guard;
-    self->base.base.check = guard_builtins_check;
-    self->init_failed = -1;
-
-    /* object allocator must initialize the structure to zeros */
-    assert(self->guard_globals == NULL);
+    self = (GuardArgRangeObject *)op;
+    self->base.base.init = guard_arg_range_init_guard;
+    self->base.base.check = guard_arg_range_check;
+    guard_arg_init(&self->arg, 0);
+    self->min = PY_LLONG_MIN;
+    self->max = PY_LLONG_MAX;
 
     return op;
 }
 
 static int
-guard_builtins_init(PyObject *op, PyObject *args, PyObject *kwargs)
+guard_arg_range_init(PyObject *op, PyObject *args, PyObject *kwargs)
 {
-    PyObject *builtins, *keys;
-    PyObject *guard_globals;
-
-    if (kwargs) {
-        PyErr_SetString(PyExc_TypeError,
-                        "keyword arguments are not supported");
-        return -1;
-    }
-    keys = args;
-
-    builtins = PyEval_GetBuiltins();
-    if (builtins == NULL) {
-        PyErr_SetString(PyExc_RuntimeError,
-                        "unable to get builtins");
-        return -1;
-    }
+    GuardArgRangeObject *self = (GuardArgRangeObject *)op;
+    static char *keywords[] = {"arg_index", "min", "max", NULL};
+    int arg_index;
+    long long min = PY_LLONG_MIN, max = PY_LLONG_MAX;
 
-    if (!PyDict_Check(builtins)) {
-        PyErr_SetString(PyExc_RuntimeError,
-                        "frame builtins is not a dict");
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i|LL:GuardArgRange", keywords,
+                                     &arg_index, &min, &max))
         return -1;
-    }
-
-    guard_globals = PyObject_CallObject((PyObject *)&GuardGlobals_Type, keys);
-    if (guard_globals == NULL)
+    if (guard_arg_check_index(arg_index) < 0)
         return -1;
 
-    if (guard_dict_init_keys(op, builtins, 0, keys) < 0) {
-        Py_DECREF(guard_globals);
+    if (min > max) {
+        PyErr_SetString(PyExc_ValueError, "min must be lower than max");
         return -1;
     }
 
-    ((GuardBuiltinsObject *)op)->guard_globals = guard_globals;
-
-    return 0;
-}
-
-static int
-guard_builtins_traverse(GuardBuiltinsObject *self, visitproc visit, void *arg)
-{
-    int res = guard_dict_traverse((GuardDictObject *)self, visit, arg);
-    if (res)
-        return res;
-    Py_VISIT(self->guard_globals);
+    guard_arg_reset(&self->arg, arg_index);
+    self->min = min;
+    self->max = max;
     return 0;
 }
 
-static PyMemberDef guard_builtins_members[] = {
-    {"guard_globals",   T_OBJECT,   offsetof(GuardBuiltinsObject, guard_globals),
+static PyMemberDef guard_arg_range_members[] = {
+    {"arg_index",   T_PYSSIZET,   offsetof(GuardArgRangeObject, arg.arg_index),
+     RESTRICTED|READONLY},
+    {"arg_name",   T_OBJECT,   offsetof(GuardArgRangeObject, arg.name),
+     RESTRICTED|READONLY},
+    {"min",   T_LONGLONG,   offsetof(GuardArgRangeObject, min),
+     RESTRICTED|READONLY},
+    {"max",   T_LONGLONG,   offsetof(GuardArgRangeObject, max),
      RESTRICTED|READONLY},
+    GUARD_MEMBERS
     {NULL}  /* Sentinel */
 };
 
-static PyTypeObject GuardBuiltins_Type = {
-    PyVarObject_HEAD_INIT(&PyType_Type, 0)
-    "fat.GuardBuiltins",
-    sizeof(GuardBuiltinsObject),
-    0,
-    (destructor)guard_builtins_dealloc,         /* tp_dealloc */
-    0,                                          /* tp_print */
-    0,                                          /* tp_getattr */
-    0,                                          /* tp_setattr */
-    0,                                          /* tp_reserved */
-    0,                                          /* tp_repr */
-    0,                                          /* tp_as_number */
-    0,                                          /* tp_as_sequence */
-    0,                                          /* tp_as_mapping */
-    0,                                          /* tp_hash */
-    0,                                          /* tp_call */
-    0,                                          /* tp_str */
-    0,                                          /* tp_getattro */
-    0,                                          /* tp_setattro */
-    0,                                          /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
-    0,                                          /* tp_doc */
-    (traverseproc)guard_builtins_traverse,      /* tp_traverse */
-    0,                                          /* tp_clear */
-    0,                                          /* tp_richcompare */
-    0,                                          /* tp_weaklistoffset */
-    0,                                          /* tp_iter */
-    0,                                          /* tp_iternext */
-    0,                                          /* tp_methods */
-    guard_builtins_members,                     /* tp_members */
-    0,                                          /* tp_getset */
-    &GuardDict_Type,                            /* tp_base */
-    0,                                          /* tp_dict */
-    0,                                          /* tp_descr_get */
-    0,                                          /* tp_descr_set */
-    0,                                          /* tp_dictoffset */
-    guard_builtins_init,                        /* tp_init */
-    0,                                          /* tp_alloc */
-    guard_builtins_new,                         /* tp_new */
-    0,                                          /* tp_free */
-};
+PyDoc_STRVAR(guard_arg_range_doc,
+"GuardArgRange(arg_index, min=-2**63, max=2**63-1)\n"
+"\n"
+"Guard on a numeric function argument which fits in a machine word: an int\n"
+"in the range [min; max], or a finite float. Other types (including int\n"
+"and float subclasses) are rejected.");
+
+static PyTypeObject GuardArgRange_Type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "fat.GuardArgRange",
+    sizeof(GuardArgRangeObject),
+    0,
+    (destructor)guard_arg_range_dealloc,        /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    guard_arg_range_doc,                        /* tp_doc */
+    (traverseproc)guard_arg_range_traverse,     /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    0,                                          /* tp_methods */
+    guard_arg_range_members,                    /* tp_members */
+    0,                                          /* tp_getset */
+    &PyFuncGuard_Type,                          /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    guard_arg_range_init,                       /* tp_init */
+    0,                                          /* tp_alloc */
+    guard_arg_range_new,                        /* tp_new */
+    0,                                          /* tp_free */
+};
+
+
+/* GuardArgShape */
+
+typedef struct {
+    GuardObject base;
+    GuardArg arg;
+    /* tuple or list */
+    PyObject *container_type;
+    /* expected length, or -1 to only require nitem items */
+    Py_ssize_t length;
+    /* types of the first items, NULL means any type */
+    Py_ssize_t nitem;
+    PyObject **item_types;
+} GuardArgShapeObject;
+
+static int
+guard_arg_shape_init_guard(PyObject *self, PyObject *func)
+{
+    GuardArgShapeObject *guard = (GuardArgShapeObject *)self;
+
+    return guard_arg_bind(&guard->arg, func);
+}
+
+static int
+check_arg_shape_guard(GuardArgShapeObject *guard, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *arg;
+    PyObject **items;
+    Py_ssize_t size, i;
+
+    if (guard_arg_get(&guard->arg, stack, nargs, kwnames, &arg))
+        return 1;
+
+    if ((PyObject *)Py_TYPE(arg) != guard->container_type)
+        return 1;
+
+    if (PyTuple_CheckExact(arg)) {
+        size = PyTuple_GET_SIZE(arg);
+        items = ((PyTupleObject *)arg)->ob_item;
+    }
+    else {
+        assert(PyList_CheckExact(arg));
+        size = PyList_GET_SIZE(arg);
+        items = ((PyListObject *)arg)->ob_item;
+    }
+
+    if (guard->length >= 0) {
+        if (size != guard->length)
+            return 1;
+    }
+    else if (size < guard->nitem)
+        return 1;
+
+    /* only check the guarded prefix */
+    for (i=0; i < guard->nitem; i++) {
+        PyObject *type = guard->item_types[i];
+
+        if (type != NULL && (PyObject *)Py_TYPE(items[i]) != type)
+            return 1;
+    }
+    return 0;
+}
+
+static int
+guard_arg_shape_check(PyObject *self, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
+{
+    GuardArgShapeObject *guard = (GuardArgShapeObject *)self;
+
+    return guard_count_check(&guard->base,
+                             check_arg_shape_guard(guard, stack, nargs, kwnames));
+}
+
+static void
+guard_arg_shape_clear(GuardArgShapeObject *self)
+{
+    Py_ssize_t i;
+
+    for (i=0; i < self->nitem; i++)
+        Py_XDECREF(self->item_types[i]);
+    PyMem_Free(self->item_types);
+    self->item_types = NULL;
+    self->nitem = 0;
+    Py_CLEAR(self->container_type);
+}
+
+static void
+guard_arg_shape_dealloc(GuardArgShapeObject *self)
+{
+    guard_arg_shape_clear(self);
+    guard_arg_clear(&self->arg);
+
+    PyFuncGuard_Type.tp_dealloc((PyObject *)self);
+}
+
+static int
+guard_arg_shape_traverse(GuardArgShapeObject *self, visitproc visit, void *arg)
+{
+    Py_ssize_t i;
+
+    Py_VISIT(self->container_type);
+    for (i=0; i < self->nitem; i++)
+        Py_VISIT(self->item_types[i]);
+    return guard_arg_traverse(&self->arg, visit, arg);
+}
+
+static PyObject *
+guard_arg_shape_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PyObject *op;
+    GuardArgShapeObject *self;
+
+    op = PyFuncGuard_Type.tp_new(type, args, kwds);
+    if (op == NULL)
+        return NULL;
+
+    self = (GuardArgShapeObject *)op;
+    self->base.base.init = guard_arg_shape_init_guard;
+    self->base.base.check = guard_arg_shape_check;
+    guard_arg_init(&self->arg, 0);
+    self->container_type = NULL;
+    self->length = -1;
+    self->nitem = 0;
+    self->item_types = NULL;
+
+    return op;
+}
+
+static int
+guard_arg_shape_init(PyObject *op, PyObject *args, PyObject *kwargs)
+{
+    GuardArgShapeObject *self = (GuardArgShapeObject *)op;
+    static char *keywords[] = {"arg_index", "container_type", "length",
+                               "item_types", NULL};
+    int arg_index;
+    PyObject *container_type;
+    PyObject *length_obj = Py_None;
+    PyObject *item_types_obj = NULL;
+    PyObject *seq = NULL;
+    Py_ssize_t length = -1, nitem = 0, i;
+    PyObject **item_types = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "iO|OO:GuardArgShape",
+                                     keywords, &arg_index, &container_type,
+                                     &length_obj, &item_types_obj))
+        return -1;
+    if (guard_arg_check_index(arg_index) < 0)
+        return -1;
+
+    if (container_type != (PyObject *)&PyTuple_Type
+        && container_type != (PyObject *)&PyList_Type) {
+        PyErr_SetString(PyExc_TypeError,
+                        "container_type must be tuple or list");
+        return -1;
+    }
+
+    if (length_obj != Py_None) {
+        length = PyLong_AsSsize_t(length_obj);
+        if (length == -1 && PyErr_Occurred())
+            return -1;
+        if (length < 0) {
+            PyErr_SetString(PyExc_ValueError, "length must be positive");
+            return -1;
+        }
+    }
+
+    if (item_types_obj != NULL) {
+        seq = PySequence_Fast(item_types_obj,
+                              "item_types must be an iterable");
+        if (seq == NULL)
+            return -1;
+        nitem = PySequence_Fast_GET_SIZE(seq);
+    }
+
+    if (length >= 0 && nitem > length) {
+        PyErr_SetString(PyExc_ValueError,
+                        "more item types than items");
+        goto error;
+    }
+
+    if (nitem) {
+        item_types = PyMem_Malloc(nitem * sizeof(item_types[0]));
+        if (item_types == NULL) {
+            PyErr_NoMemory();
+            goto error;
+        }
+        for (i=0; i < nitem; i++) {
+            PyObject *type = PySequence_Fast_GET_ITEM(seq, i);
+
+            if (type == Py_None) {
+                item_types[i] = NULL;
+                continue;
+            }
+            if (!PyType_Check(type)) {
+                PyErr_Format(PyExc_TypeError,
+                             "item type must be a type or None, got %s",
+                             Py_TYPE(type)->tp_name);
+                nitem = i;
+                goto error;
+            }
+            Py_INCREF(type);
+            item_types[i] = type;
+        }
+    }
+    Py_CLEAR(seq);
+
+    guard_arg_shape_clear(self);
+
+    guard_arg_reset(&self->arg, arg_index);
+    Py_INCREF(container_type);
+    self->container_type = container_type;
+    self->length = length;
+    self->nitem = nitem;
+    self->item_types = item_types;
+    return 0;
+
+error:
+    for (i=0; i < nitem && item_types != NULL; i++)
+        Py_XDECREF(item_types[i]);
+    PyMem_Free(item_types);
+    Py_XDECREF(seq);
+    return -1;
+}
+
+static PyObject*
+guard_arg_shape_get_length(GuardArgShapeObject *self)
+{
+    if (self->length < 0)
+        Py_RETURN_NONE;
+    return PyLong_FromSsize_t(self->length);
+}
+
+static PyObject*
+guard_arg_shape_get_item_types(GuardArgShapeObject *self)
+{
+    PyObject *tuple;
+    Py_ssize_t i;
+
+    tuple = PyTuple_New(self->nitem);
+    if (tuple == NULL)
+        return NULL;
+
+    for (i=0; i < self->nitem; i++) {
+        PyObject *type = self->item_types[i];
+
+        if (type == NULL)
+            type = Py_None;
+        Py_INCREF(type);
+        PyTuple_SET_ITEM(tuple, i, type);
+    }
+    return tuple;
+}
+
+static PyGetSetDef guard_arg_shape_getsetlist[] = {
+    {"length", (getter)guard_arg_shape_get_length},
+    {"item_types", (getter)guard_arg_shape_get_item_types},
+    {NULL} /* Sentinel */
+};
+
+static PyMemberDef guard_arg_shape_members[] = {
+    {"arg_index",   T_PYSSIZET,   offsetof(GuardArgShapeObject, arg.arg_index),
+     RESTRICTED|READONLY},
+    {"arg_name",   T_OBJECT,   offsetof(GuardArgShapeObject, arg.name),
+     RESTRICTED|READONLY},
+    {"container_type",   T_OBJECT,   offsetof(GuardArgShapeObject, container_type),
+     RESTRICTED|READONLY},
+    GUARD_MEMBERS
+    {NULL}  /* Sentinel */
+};
+
+PyDoc_STRVAR(guard_arg_shape_doc,
+"GuardArgShape(arg_index, container_type, length=None, item_types=())\n"
+"\n"
+"Guard on the shape of a tuple or list function argument: the argument\n"
+"type must be container_type (exact type), its length must be length\n"
+"(if not None), and the type of the item i must be item_types[i] (exact\n"
+"type, None means any type). Only the items of item_types are checked.");
+
+static PyTypeObject GuardArgShape_Type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "fat.GuardArgShape",
+    sizeof(GuardArgShapeObject),
+    0,
+    (destructor)guard_arg_shape_dealloc,        /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    guard_arg_shape_doc,                        /* tp_doc */
+    (traverseproc)guard_arg_shape_traverse,     /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    0,                                          /* tp_methods */
+    guard_arg_shape_members,                    /* tp_members */
+    guard_arg_shape_getsetlist,                 /* tp_getset */
+    &PyFuncGuard_Type,                          /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    guard_arg_shape_init,                       /* tp_init */
+    0,                                          /* tp_alloc */
+    guard_arg_shape_new,                        /* tp_new */
+    0,                                          /* tp_free */
+};
+
+
+/* GuardFunc */
+
+typedef struct {
+    GuardObject base;
+    PyObject *func;
+    PyObject *code;
+} GuardFuncObject;
+
+static int
+guard_func_init_guard(PyObject *self, PyObject *func)
+{
+    GuardFuncObject *guard = (GuardFuncObject *)self;
+
+    if ((PyObject *)func == guard->func) {
+        /* Replacing the code object of a function already removes its
+         * specialized code, no need to add a guard */
+        PyErr_SetString(PyExc_ValueError,
+                        "useless GuardFunc, a function already watch itself");
+        return -1;
+    }
+    return 0;
+}
+
+static int
+guard_func_check(PyObject *self, PyObject** stack, Py_ssize_t nargs, PyObject *kwnames)
+{
+    GuardFuncObject *guard = (GuardFuncObject *)self;
+    PyFunctionObject *func;
+    int res;
+
+    assert(Py_TYPE(guard->func) == &PyFunction_Type);
+    func = (PyFunctionObject *)guard->func;
+
+    if (((PyFunctionObject *)func)->func_code != guard->code)
+        res = 2;
+    else
+        res = 0;
+
+    return guard_count_check(&guard->base, res);
+}
+
+static void
+guard_func_dealloc(GuardFuncObject *self)
+{
+    GuardFuncObject *guard = (GuardFuncObject *)self;
+
+    Py_XDECREF(guard->func);
+    Py_XDECREF(guard->code);
+
+    PyFuncGuard_Type.tp_dealloc((PyObject *)self);
+}
+
+static int
+guard_func_traverse(GuardFuncObject *self, visitproc visit, void *arg)
+{
+    GuardFuncObject *guard = (GuardFuncObject *)self;
+
+    Py_VISIT(guard->func);
+    Py_VISIT(guard->code);
+    return 0;
+}
+
+static PyObject *
+guard_func_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PyObject *op;
+    GuardFuncObject *self;
+
+    op = PyFuncGuard_Type.tp_new(type, args, kwds);
+    if (op == NULL)
+        return NULL;
+
+    self = (GuardFuncObject *)op;
+    self->base.base.init = guard_func_init_guard;
+    self->base.base.check = guard_func_check;
+    self->func = NULL;
+    self->code = NULL;
+
+    return op;
+}
+
+static int
+guard_func_init(PyObject *op, PyObject *args, PyObject *kwargs)
+{
+    GuardFuncObject *self = (GuardFuncObject *)op;
+    static char *keywords[] = {"func", NULL};
+    PyObject *func;
+    PyObject *code;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O:GuardFunc", keywords,
+                                     &func))
+        return -1;
+
+    if (!PyFunction_Check(func)) {
+        PyErr_Format(PyExc_TypeError,
+                     "func must be a function, not %s",
+                     Py_TYPE(func)->tp_name);
+        return -1;
+    }
+
+    code = ((PyFunctionObject*)func)->func_code;
+
+    Py_INCREF(func);
+    self->func = func;
+    Py_INCREF(code);
+    self->code = code;
+    return 0;
+}
+
+static PyMemberDef guard_func_members[] = {
+    {"func",   T_OBJECT,   offsetof(GuardFuncObject, func),
+     RESTRICTED|READONLY},
+    {"code",   T_OBJECT,   offsetof(GuardFuncObject, code),
+     RESTRICTED|READONLY},
+    GUARD_MEMBERS
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject GuardFunc_Type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "fat.GuardFunc",
+    sizeof(GuardFuncObject),
+    0,
+    (destructor)guard_func_dealloc,             /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    0,                                          /* tp_doc */
+    (traverseproc)guard_func_traverse,          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    0,                                          /* tp_methods */
+    guard_func_members,                         /* tp_members */
+    0,                                          /* tp_getset */
+    &PyFuncGuard_Type,                      /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    guard_func_init,                            /* tp_init */
+    0,                                          /* tp_alloc */
+    guard_func_new,                             /* tp_new */
+    0,                                          /* tp_free */
+};
+
+
+/* GuardTypeVersion */
+
+/* Get the version tag of a type, assign a new version tag if needed.
+   Return 0 if the type cannot have a version tag.
+
+   The version tag is invalidated by PyType_Modified() when the type or one
+   of its base classes is modified: a valid tag covers the whole MRO. */
+static unsigned int
+type_version_tag(PyTypeObject *type)
+{
+    static PyObject *name = NULL;
+
+    if (PyType_HasFeature(type, Py_TPFLAGS_VALID_VERSION_TAG))
+        return type->tp_version_tag;
+
+    if (name == NULL) {
+        name = PyUnicode_InternFromString("__fat_version_tag__");
+        if (name == NULL) {
+            PyErr_Clear();
+            return 0;
+        }
+    }
+
+    /* _PyType_Lookup() assigns a version tag to the type (if the method
+       cache is enabled and the name is interned) */
+    (void)_PyType_Lookup(type, name);
+
+    if (!PyType_HasFeature(type, Py_TPFLAGS_VALID_VERSION_TAG))
+        return 0;
+    return type->tp_version_tag;
+}
+
+typedef struct {
+    GuardObject base;
+    PyObject *type;
+    unsigned int version_tag;
+    /* names: tuple of attribute names, values: C array of the values of
+       the attributes when the guard was created (NULL if missing) */
+    PyObject *names;
+    PyObject **values;
+} GuardTypeVersionObject;
+
+/* Slow path: the type or one of its base classes was modified. Fail if one
+   watched attribute was modified, otherwise remember the new version. */
+static int
+revalidate_type_version_guard(GuardTypeVersionObject *guard)
+{
+    PyTypeObject *type = (PyTypeObject *)guard->type;
+    unsigned int version_tag;
+    Py_ssize_t i, nname;
+
+    GUARD_STAT_INC(&guard->base, nb_slow);
+
+    nname = PyTuple_GET_SIZE(guard->names);
+    if (nname == 0) {
+        /* no attribute given: any modification makes the guard fail */
+        return 2;
+    }
+
+    version_tag = type_version_tag(type);
+    if (version_tag == 0)
+        return 2;
+
+    for (i=0; i < nname; i++) {
+        PyObject *name = PyTuple_GET_ITEM(guard->names, i);
+
+        if (_PyType_Lookup(type, name) != guard->values[i])
+            return 2;
+    }
+
+    guard->version_tag = version_tag;
+    return 0;
+}
+
+static int
+check_type_version_guard(GuardTypeVersionObject *guard)
+{
+    PyTypeObject *type = (PyTypeObject *)guard->type;
+
+    if (likely(type->tp_version_tag == guard->version_tag
+               && PyType_HasFeature(type, Py_TPFLAGS_VALID_VERSION_TAG)))
+        return 0;
+
+    return revalidate_type_version_guard(guard);
+}
+
+static int
+guard_type_version_check(PyObject *self, PyObject** stack, Py_ssize_t nargs, PyObject *kwnames)
+{
+    GuardTypeVersionObject *guard = (GuardTypeVersionObject *)self;
+
+    return guard_count_check(&guard->base, check_type_version_guard(guard));
+}
+
+static void
+guard_type_version_clear(GuardTypeVersionObject *guard)
+{
+    Py_ssize_t i;
+
+    if (guard->values != NULL) {
+        for (i=0; i < PyTuple_GET_SIZE(guard->names); i++)
+            Py_XDECREF(guard->values[i]);
+        PyMem_Free(guard->values);
+        guard->values = NULL;
+    }
+    Py_CLEAR(guard->names);
+    Py_CLEAR(guard->type);
+}
+
+static void
+guard_type_version_dealloc(GuardTypeVersionObject *self)
+{
+    guard_type_version_clear(self);
+
+    PyFuncGuard_Type.tp_dealloc((PyObject *)self);
+}
+
+static int
+guard_type_version_traverse(GuardTypeVersionObject *guard, visitproc visit, void *arg)
+{
+    Py_ssize_t i;
+
+    Py_VISIT(guard->type);
+    Py_VISIT(guard->names);
+    if (guard->values != NULL) {
+        for (i=0; i < PyTuple_GET_SIZE(guard->names); i++)
+            Py_VISIT(guard->values[i]);
+    }
+    return 0;
+}
+
+static PyObject *
+guard_type_version_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PyObject *op;
+    GuardTypeVersionObject *self;
+
+    op = PyFuncGuard_Type.tp_new(type, args, kwds);
+    if (op == NULL)
+        return NULL;
+
+    self = (GuardTypeVersionObject *)op;
+    self->base.base.check = guard_type_version_check;
+    self->type = NULL;
+    self->version_tag = 0;
+    self->names = NULL;
+    self->values = NULL;
+
+    return op;
+}
+
+static int
+guard_type_version_init(PyObject *op, PyObject *args, PyObject *kwargs)
+{
+    GuardTypeVersionObject *self = (GuardTypeVersionObject *)op;
+    PyObject *type, *names;
+    PyObject **values = NULL;
+    unsigned int version_tag;
+    Py_ssize_t i, nname;
+
+    if (kwargs) {
+        PyErr_SetString(PyExc_TypeError,
+                        "keyword arguments are not supported");
+        return -1;
+    }
+
+    if (PyTuple_GET_SIZE(args) < 1) {
+        PyErr_SetString(PyExc_TypeError,
+                        "GuardTypeVersion() requires a type");
+        return -1;
+    }
+    type = PyTuple_GET_ITEM(args, 0);
+
+    if (!PyType_Check(type)) {
+        PyErr_Format(PyExc_TypeError,
+                     "type must be a type, not %s",
+                     Py_TYPE(type)->tp_name);
+        return -1;
+    }
+
+    nname = PyTuple_GET_SIZE(args) - 1;
+    names = PyTuple_New(nname);
+    if (names == NULL)
+        return -1;
+
+    for (i=0; i < nname; i++) {
+        PyObject *name = PyTuple_GET_ITEM(args, 1 + i);
+
+        if (!PyUnicode_Check(name)) {
+            PyErr_Format(PyExc_TypeError,
+                         "attribute name must be a str, not %s",
+                         Py_TYPE(name)->tp_name);
+            goto error;
+        }
+        /* Intern the name to use the method cache */
+        Py_INCREF(name);
+        PyUnicode_InternInPlace(&name);
+        PyTuple_SET_ITEM(names, i, name);
+    }
+
+    version_tag = type_version_tag((PyTypeObject *)type);
+    if (version_tag == 0) {
+        PyErr_Format(PyExc_ValueError,
+                     "unable to get a version tag of the type %s",
+                     ((PyTypeObject *)type)->tp_name);
+        goto error;
+    }
+
+    values = PyMem_Malloc(sizeof(values[0]) * Py_MAX(nname, 1));
+    if (values == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    for (i=0; i < nname; i++) {
+        PyObject *name = PyTuple_GET_ITEM(names, i);
+
+        values[i] = _PyType_Lookup((PyTypeObject *)type, name);
+        Py_XINCREF(values[i]);
+    }
+
+    guard_type_version_clear(self);
+
+    Py_INCREF(type);
+    self->type = type;
+    self->version_tag = version_tag;
+    self->names = names;
+    self->values = values;
+    return 0;
+
+error:
+    Py_DECREF(names);
+    return -1;
+}
+
+static PyMemberDef guard_type_version_members[] = {
+    {"type",   T_OBJECT,   offsetof(GuardTypeVersionObject, type),
+     RESTRICTED|READONLY},
+    {"names",   T_OBJECT,   offsetof(GuardTypeVersionObject, names),
+     RESTRICTED|READONLY},
+    {"version_tag",   T_UINT,   offsetof(GuardTypeVersionObject, version_tag),
+     RESTRICTED|READONLY},
+    GUARD_MEMBERS
+    {NULL}  /* Sentinel */
+};
+
+PyDoc_STRVAR(guard_type_version_doc,
+"GuardTypeVersion(type, *names)\n"
+"\n"
+"Guard on the version tag of a type: the check fails if the type or one of\n"
+"its base classes is modified.\n"
+"\n"
+"If attribute names are given, a modification only makes the check fail\n"
+"if the value of one of these attributes changed.");
+
+static PyTypeObject GuardTypeVersion_Type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "fat.GuardTypeVersion",
+    sizeof(GuardTypeVersionObject),
+    0,
+    (destructor)guard_type_version_dealloc,     /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    guard_type_version_doc,                     /* tp_doc */
+    (traverseproc)guard_type_version_traverse,  /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    0,                                          /* tp_methods */
+    guard_type_version_members,                 /* tp_members */
+    0,                                          /* tp_getset */
+    &PyFuncGuard_Type,                          /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    guard_type_version_init,                    /* tp_init */
+    0,                                          /* tp_alloc */
+    guard_type_version_new,                     /* tp_new */
+    0,                                          /* tp_free */
+};
+
+
+/* Dictionary internals, copied from Objects/dict-common.h of CPython 3.6 */
+
+typedef struct {
+    Py_hash_t me_hash;
+    PyObject *me_key;
+    PyObject *me_value;
+} PyDictKeyEntry;
+
+typedef Py_ssize_t (*dict_lookup_func)
+(PyDictObject *mp, PyObject *key, Py_hash_t hash, PyObject ***value_addr,
+ Py_ssize_t *hashpos);
+
+#define DKIX_EMPTY (-1)
+#define DKIX_ERROR (-3)
+
+struct _dictkeysobject {
+    Py_ssize_t dk_refcnt;
+    Py_ssize_t dk_size;
+    dict_lookup_func dk_lookup;
+    Py_ssize_t dk_usable;
+    Py_ssize_t dk_nentries;
+    union {
+        int8_t as_1[8];
+        int16_t as_2[4];
+        int32_t as_4[2];
+#if SIZEOF_VOID_P > 4
+        int64_t as_8[1];
+#endif
+    } dk_indices;
+};
+
+#define DK_SIZE(dk) ((dk)->dk_size)
+#if SIZEOF_VOID_P > 4
+#define DK_IXSIZE(dk)                          \
+    (DK_SIZE(dk) <= 0xff ?                     \
+        1 : DK_SIZE(dk) <= 0xffff ?            \
+            2 : DK_SIZE(dk) <= 0xffffffff ?    \
+                4 : sizeof(int64_t))
+#else
+#define DK_IXSIZE(dk)                          \
+    (DK_SIZE(dk) <= 0xff ?                     \
+        1 : DK_SIZE(dk) <= 0xffff ?            \
+            2 : sizeof(int32_t))
+#endif
+#define DK_ENTRIES(dk) \
+    ((PyDictKeyEntry*)(&(dk)->dk_indices.as_1[DK_SIZE(dk) * DK_IXSIZE(dk)]))
+
+/* Reference counting of keys tables, copied from Objects/dictobject.c */
+#define DK_DEBUG_INCREF _Py_INC_REFTOTAL _Py_REF_DEBUG_COMMA
+#define DK_DEBUG_DECREF _Py_DEC_REFTOTAL _Py_REF_DEBUG_COMMA
+#define DK_INCREF(dk) (DK_DEBUG_INCREF ++(dk)->dk_refcnt)
+#define DK_DECREF(dk) \
+    do { \
+        if (DK_DEBUG_DECREF (--(dk)->dk_refcnt) == 0) \
+            free_keys_object(dk); \
+    } while (0)
+
+static void
+free_keys_object(PyDictKeysObject *keys)
+{
+    PyDictKeyEntry *entries = DK_ENTRIES(keys);
+    Py_ssize_t i, n;
+
+    for (i = 0, n = keys->dk_nentries; i < n; i++) {
+        Py_XDECREF(entries[i].me_key);
+        Py_XDECREF(entries[i].me_value);
+    }
+    PyObject_FREE(keys);
+}
+
+/* Lookup a key in the hash table of a dict: return the index of its entry
+   in the keys table (or DKIX_EMPTY if the key doesn't exist) and set *pvalue
+   to its value (or NULL). Return DKIX_ERROR on error. */
+static Py_ssize_t
+dict_lookup_index(PyDictObject *mp, PyObject *key, PyObject **pvalue)
+{
+    Py_hash_t hash;
+    PyObject **value_addr;
+    Py_ssize_t ix;
+
+    assert(PyDict_Check(mp));
+
+    /* keys are interned strings: the hash is cached */
+    hash = PyObject_Hash(key);
+    if (hash == -1)
+        return DKIX_ERROR;
+
+    ix = mp->ma_keys->dk_lookup(mp, key, hash, &value_addr, NULL);
+    if (ix < 0) {
+        *pvalue = NULL;
+        return ix;
+    }
+
+    *pvalue = *value_addr;
+    return ix;
+}
+
+/* Check if d[key] can be looked up directly in the hash table of a dict:
+   the dict is an exact dict or an exact OrderedDict. The check is only done
+   once per dict, so other dict subclasses are excluded: __getitem__ or
+   __missing__ can be added to their class, or their __class__ can be
+   replaced. */
+static int
+dict_has_direct_lookup(PyObject *dict)
+{
+    return (PyDict_CheckExact(dict) || PyODict_CheckExact(dict));
+}
+
+/* mappingproxy internals, copied from Objects/descrobject.c of CPython 3.6 */
+typedef struct {
+    PyObject_HEAD
+    PyObject *mapping;
+} mappingproxyobject;
+
+/* Get the dict watched by a dict guard: obj, or the dict of a mappingproxy
+   like the __dict__ of a class. Return a borrowed reference, or NULL if obj
+   is not a dict. */
+static PyObject*
+guard_dict_unwrap(PyObject *obj)
+{
+    if (Py_TYPE(obj) == &PyDictProxy_Type)
+        obj = ((mappingproxyobject *)obj)->mapping;
+    if (!PyDict_Check(obj))
+        return NULL;
+    return obj;
+}
+
+
+/* DictWatcher: record of the watched keys of a dict, shared by all guards
+   watching the dict. Watched keys are revalidated once per version of the
+   dict, and guards only compare their values when the epoch of the watcher
+   changed. */
+
+typedef struct {
+    PyObject *key;
+    /* current value of the key, NULL if the key doesn't exist */
+    PyObject *value;
+    /* keys table and index of the entry where key was found by the last
+       lookup, used to revalidate the key without a new lookup */
+    PyDictKeysObject *dict_keys;
+    Py_ssize_t index;
+} WatchedKey;
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *dict;
+    /* version of the dict when watched keys were last revalidated */
+    PY_UINT64_T dict_version;
+    /* 1 if keys are looked up in the hash table of the dict, 0 if they are
+       looked up with d[key] (dict subclass), see dict_has_direct_lookup() */
+    int direct_lookup;
+    /* incremented each time that the value of a watched key changes */
+    PY_UINT64_T epoch;
+    /* key => index in keys */
+    PyObject *key_index;
+    Py_ssize_t nkey;
+    Py_ssize_t allocated;
+    WatchedKey *keys;
+} DictWatcherObject;
+
+/* Registry of watchers: dict => borrowed reference to the watcher of the
+   dict. Hash table with linear probing keyed by the address of the dict, so
+   that getting or unregistering a watcher doesn't allocate memory. */
+typedef struct {
+    PyObject *dict;
+    DictWatcherObject *watcher;
+} DictWatcherEntry;
+
+/* initial size of the registry, must be a power of 2 */
+#define DICT_WATCHERS_MINSIZE 16
+
+static DictWatcherEntry *dict_watchers = NULL;
+/* size of the table, a power of 2 */
+static size_t dict_watchers_size = 0;
+/* number of registered watchers, at most half of the size */
+static size_t dict_watchers_used = 0;
+
+static PyTypeObject DictWatcher_Type;
+
+/* Get the entry of the dict, or the empty entry where the dict should be
+   inserted if the dict has no watcher */
+static DictWatcherEntry*
+dict_watchers_lookup(PyObject *dict)
+{
+    size_t mask = dict_watchers_size - 1;
+    size_t i = (size_t)_Py_HashPointer(dict) & mask;
+
+    while (dict_watchers[i].dict != NULL && dict_watchers[i].dict != dict)
+        i = (i + 1) & mask;
+    return &dict_watchers[i];
+}
+
+static int
+dict_watchers_resize(size_t size)
+{
+    DictWatcherEntry *old = dict_watchers;
+    size_t old_size = dict_watchers_size;
+    size_t i;
+
+    if (size > PY_SSIZE_T_MAX / sizeof(DictWatcherEntry)) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    dict_watchers = PyMem_Calloc(size, sizeof(DictWatcherEntry));
+    if (dict_watchers == NULL) {
+        dict_watchers = old;
+        PyErr_NoMemory();
+        return -1;
+    }
+    dict_watchers_size = size;
+
+    for (i=0; i < old_size; i++) {
+        if (old[i].dict != NULL)
+            *dict_watchers_lookup(old[i].dict) = old[i];
+    }
+    PyMem_Free(old);
+    return 0;
+}
+
+static int
+dict_watchers_add(PyObject *dict, DictWatcherObject *watcher)
+{
+    DictWatcherEntry *entry;
+
+    if ((dict_watchers_used + 1) * 2 > dict_watchers_size) {
+        if (dict_watchers_resize(dict_watchers_size * 2) < 0)
+            return -1;
+    }
+
+    entry = dict_watchers_lookup(dict);
+    assert(entry->dict == NULL);
+    entry->dict = dict;
+    entry->watcher = watcher;
+    dict_watchers_used++;
+    return 0;
+}
+
+static void
+dict_watchers_remove(PyObject *dict, DictWatcherObject *watcher)
+{
+    size_t mask = dict_watchers_size - 1;
+    DictWatcherEntry *entry;
+    size_t i, j, k;
+
+    entry = dict_watchers_lookup(dict);
+    if (entry->dict == NULL || entry->watcher != watcher) {
+        /* the watcher was not registered */
+        return;
+    }
+    dict_watchers_used--;
+
+    /* move back the following entries of the cluster to not break their
+       probe sequence */
+    i = entry - dict_watchers;
+    j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (dict_watchers[j].dict == NULL)
+            break;
+        k = (size_t)_Py_HashPointer(dict_watchers[j].dict) & mask;
+        /* the entry j can be moved to i if k is not in (i, j] */
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        dict_watchers[i] = dict_watchers[j];
+        i = j;
+    }
+    dict_watchers[i].dict = NULL;
+    dict_watchers[i].watcher = NULL;
+}
+
+#define DICT_VERSION(dict) (((PyDictObject *)(dict))->ma_version_tag)
+
+static int
+dict_watcher_lookup(DictWatcherObject *watcher, Py_ssize_t index,
+                    PyObject **pvalue)
+{
+    PyObject *dict = watcher->dict;
+    WatchedKey *wk = &watcher->keys[index];
+
+    if (likely(watcher->direct_lookup)) {
+        PyDictObject *mp = (PyDictObject *)dict;
+        PyDictKeysObject *keys = mp->ma_keys;
+        Py_ssize_t ix = wk->index;
+
+        if (keys == wk->dict_keys
+            && ix >= 0 && ix < keys->dk_nentries
+            && DK_ENTRIES(keys)[ix].me_key == wk->key) {
+            /* the dict was not resized and the entry still holds the key */
+            if (mp->ma_values != NULL)
+                *pvalue = mp->ma_values[ix];
+            else
+                *pvalue = DK_ENTRIES(keys)[ix].me_value;
+            return 0;
+        }
+
+        /* the lookup can execute arbitrary code (__eq__) which adds keys
+           to the watcher and so reallocates watcher->keys */
+        ix = dict_lookup_index(mp, wk->key, pvalue);
+        if (ix == DKIX_ERROR)
+            return -1;
+
+        wk = &watcher->keys[index];
+        wk->dict_keys = mp->ma_keys;
+        wk->index = ix;
+    }
+    else {
+        PyObject *value;
+
+        /* slow path for dict subclasses overriding __getitem__ */
+        value = PyObject_GetItem(dict, wk->key);
+        if (value == NULL && PyErr_Occurred()) {
+            if (!PyErr_ExceptionMatches(PyExc_KeyError)) {
+                /* lookup failed */
+                return -1;
+            }
+            /* key doesn't exist */
+            PyErr_Clear();
+        }
+
+        /* we only care of the value pointer, not its content,
+           so it is safe to use the pointer after Py_DECREF */
+        Py_XDECREF(value);
+        *pvalue = value;
+    }
+    return 0;
+}
+
+/* Revalidate watched keys: update their value and the epoch */
+static int
+dict_watcher_update(DictWatcherObject *watcher)
+{
+    PY_UINT64_T dict_version;
+    Py_ssize_t i;
+    int res = 0;
+
+    dict_version = DICT_VERSION(watcher->dict);
+    if (dict_version == watcher->dict_version)
+        return 0;
+
+    /* Py_DECREF(old_value) can execute arbitrary code */
+    Py_INCREF(watcher);
+
+    for (i=0; i < watcher->nkey; i++) {
+        WatchedKey *wk;
+        PyObject *value, *old_value;
+
+        if (dict_watcher_lookup(watcher, i, &value) < 0) {
+            res = -1;
+            goto done;
+        }
+
+        wk = &watcher->keys[i];
+        if (value != wk->value) {
+            old_value = wk->value;
+            Py_XINCREF(value);
+            wk->value = value;
+            watcher->epoch++;
+            Py_XDECREF(old_value);
+        }
+    }
+
+    /* if the dict was modified by Py_DECREF(), the version is different
+       and keys will be revalidated again */
+    watcher->dict_version = dict_version;
+
+done:
+    Py_DECREF(watcher);
+    return res;
+}
+
+/* Get the index of a watched key, start to watch the key if needed */
+static Py_ssize_t
+dict_watcher_add_key(DictWatcherObject *watcher, PyObject *key)
+{
+    PyObject *index_obj;
+    WatchedKey *wk;
+    Py_ssize_t index;
+    PyObject *value, *old_value;
+
+    if (dict_watcher_update(watcher) < 0)
+        return -1;
+
+    index_obj = PyDict_GetItemWithError(watcher->key_index, key);
+    if (index_obj != NULL)
+        return PyLong_AsSsize_t(index_obj);
+    if (PyErr_Occurred())
+        return -1;
+
+    if (watcher->nkey == watcher->allocated) {
+        Py_ssize_t allocated = watcher->allocated * 2 + 4;
+        WatchedKey *keys;
+
+        if (allocated > PY_SSIZE_T_MAX / (Py_ssize_t)sizeof(WatchedKey)) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        keys = PyMem_Realloc(watcher->keys, allocated * sizeof(WatchedKey));
+        if (keys == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        watcher->keys = keys;
+        watcher->allocated = allocated;
+    }
+
+    /* reserve the entry first: hashing and comparing keys can execute
+       arbitrary code which adds other keys to the watcher */
+    index = watcher->nkey;
+    wk = &watcher->keys[index];
+    Py_INCREF(key);
+    wk->key = key;
+    wk->value = NULL;
+    wk->dict_keys = NULL;
+    wk->index = DKIX_EMPTY;
+    watcher->nkey++;
+
+    index_obj = PyLong_FromSsize_t(index);
+    if (index_obj == NULL)
+        goto error;
+    if (PyDict_SetItem(watcher->key_index, key, index_obj) < 0) {
+        Py_DECREF(index_obj);
+        goto error;
+    }
+    Py_DECREF(index_obj);
+
+    if (dict_watcher_lookup(watcher, index, &value) < 0)
+        goto error;
+
+    /* the entry may have been revalidated during the lookup */
+    wk = &watcher->keys[index];
+    old_value = wk->value;
+    Py_XINCREF(value);
+    wk->value = value;
+    Py_XDECREF(old_value);
+    return index;
+
+error:
+    /* keep the entry, but revalidate all keys at the next update */
+    watcher->dict_version = 0;
+    return -1;
+}
+
+/* Get the watcher of a dict, create it if needed */
+static DictWatcherObject*
+dict_watcher_get(PyObject *dict)
+{
+    DictWatcherEntry *entry;
+    DictWatcherObject *watcher;
+
+    entry = dict_watchers_lookup(dict);
+    if (entry->dict != NULL) {
+        watcher = entry->watcher;
+        Py_INCREF(watcher);
+        return watcher;
+    }
+
+    watcher = PyObject_GC_New(DictWatcherObject, &DictWatcher_Type);
+    if (watcher == NULL)
+        return NULL;
+
+    Py_INCREF(dict);
+    watcher->dict = dict;
+    watcher->dict_version = DICT_VERSION(dict);
+    watcher->direct_lookup = dict_has_direct_lookup(dict);
+    watcher->epoch = 0;
+    watcher->nkey = 0;
+    watcher->allocated = 0;
+    watcher->keys = NULL;
+    watcher->key_index = PyDict_New();
+    if (watcher->key_index == NULL) {
+        Py_DECREF(watcher);
+        return NULL;
+    }
+
+    if (dict_watchers_add(dict, watcher) < 0) {
+        Py_DECREF(watcher);
+        return NULL;
+    }
+
+    PyObject_GC_Track(watcher);
+    return watcher;
+}
+
+static void
+dict_watcher_dealloc(DictWatcherObject *watcher)
+{
+    Py_ssize_t i;
+
+    PyObject_GC_UnTrack(watcher);
+
+    if (watcher->dict != NULL)
+        dict_watchers_remove(watcher->dict, watcher);
+
+    for (i=0; i < watcher->nkey; i++) {
+        Py_DECREF(watcher->keys[i].key);
+        Py_XDECREF(watcher->keys[i].value);
+    }
+    PyMem_Free(watcher->keys);
+    Py_XDECREF(watcher->key_index);
+    Py_XDECREF(watcher->dict);
+
+    PyObject_GC_Del(watcher);
+}
+
+static int
+dict_watcher_traverse(DictWatcherObject *watcher, visitproc visit, void *arg)
+{
+    Py_ssize_t i;
+
+    Py_VISIT(watcher->dict);
+    Py_VISIT(watcher->key_index);
+    for (i=0; i < watcher->nkey; i++) {
+        Py_VISIT(watcher->keys[i].key);
+        Py_VISIT(watcher->keys[i].value);
+    }
+    return 0;
+}
+
+static PyTypeObject DictWatcher_Type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "fat._DictWatcher",
+    sizeof(DictWatcherObject),
+    0,
+    (destructor)dict_watcher_dealloc,           /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    0,                                          /* tp_doc */
+    (traverseproc)dict_watcher_traverse,        /* tp_traverse */
+};
+
+
+/* GuardDict */
+
+typedef struct {
+    PyObject *key;
+    /* value of the key when the guard was created */
+    PyObject *value;
+    /* index of the key in the keys of the watcher */
+    Py_ssize_t index;
+} GuardDictPair;
+
+/* maximum number of keys stored inline in GuardDictKeys */
+#define GUARD_DICT_SMALL 3
+
+/* Keys of a dict watched by a guard */
+typedef struct {
+    PyObject *dict;
+    /* object exposed as the dict attribute of the guard: dict, or the
+       mappingproxy of dict passed to the guard */
+    PyObject *mapping;
+    DictWatcherObject *watcher;
+    /* version of the dict when the keys were last validated: PEP 509
+       versions are unique, so an unchanged version means that the dict was
+       not modified since */
+    PY_UINT64_T dict_version;
+    /* epoch of the watcher when the keys were last validated */
+    PY_UINT64_T epoch;
+    Py_ssize_t npair;
+    /* small_pairs, or an array allocated on the heap for many keys */
+    GuardDictPair *pairs;
+    GuardDictPair small_pairs[GUARD_DICT_SMALL];
+} GuardDictKeys;
+
+typedef struct {
+    GuardObject base;
+    GuardDictKeys keys;
+} GuardDictObject;
+
+static void
+guard_dict_pair_dealloc(GuardDictPair *pair)
+{
+    Py_CLEAR(pair->key);
+    Py_CLEAR(pair->value);
+}
+
+static void
+guard_dict_keys_init(GuardDictKeys *gkeys)
+{
+    gkeys->dict = NULL;
+    gkeys->mapping = NULL;
+    gkeys->watcher = NULL;
+    gkeys->dict_version = 0;
+    gkeys->epoch = 0;
+    gkeys->npair = 0;
+    gkeys->pairs = gkeys->small_pairs;
+}
+
+static void
+guard_dict_keys_clear(GuardDictKeys *gkeys)
+{
+    Py_ssize_t i;
+
+    Py_CLEAR(gkeys->dict);
+    Py_CLEAR(gkeys->mapping);
+    Py_CLEAR(gkeys->watcher);
+    for (i=0; i < gkeys->npair; i++)
+        guard_dict_pair_dealloc(&gkeys->pairs[i]);
+    gkeys->npair = 0;
+    if (gkeys->pairs != gkeys->small_pairs)
+        PyMem_Free(gkeys->pairs);
+    gkeys->pairs = gkeys->small_pairs;
+}
+
+static int
+guard_dict_keys_traverse(GuardDictKeys *gkeys, visitproc visit, void *arg)
+{
+    Py_ssize_t i;
+
+    Py_VISIT(gkeys->dict);
+    Py_VISIT(gkeys->mapping);
+    Py_VISIT(gkeys->watcher);
+    for (i=0; i < gkeys->npair; i++) {
+        Py_VISIT(gkeys->pairs[i].key);
+        Py_VISIT(gkeys->pairs[i].value);
+    }
+    return 0;
+}
+
+/* Copy watched keys, src and dst must be different */
+static int
+guard_dict_keys_copy(GuardDictKeys *dst, GuardDictKeys *src)
+{
+    GuardDictPair *pairs;
+    Py_ssize_t i;
+
+    guard_dict_keys_clear(dst);
+
+    if (src->npair > GUARD_DICT_SMALL) {
+        pairs = PyMem_Malloc(sizeof(GuardDictPair) * src->npair);
+        if (pairs == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        dst->pairs = pairs;
+    }
+
+    for (i=0; i < src->npair; i++) {
+        dst->pairs[i] = src->pairs[i];
+        Py_INCREF(dst->pairs[i].key);
+        Py_XINCREF(dst->pairs[i].value);
+    }
+    dst->npair = src->npair;
+
+    Py_XINCREF(src->dict);
+    dst->dict = src->dict;
+    Py_XINCREF(src->mapping);
+    dst->mapping = src->mapping;
+    Py_XINCREF(src->watcher);
+    dst->watcher = src->watcher;
+    dst->dict_version = src->dict_version;
+    dst->epoch = src->epoch;
+    return 0;
+}
+
+/* Fast path: a single comparison of the dict version, the watcher is only
+   used if the dict was modified */
+static inline int
+dict_guard_changed(GuardDictKeys *gkeys)
+{
+    assert(PyDict_Check(gkeys->dict));
+    return (DICT_VERSION(gkeys->dict) != gkeys->dict_version);
+}
+
+/* Slow path: revalidate the watched keys of the dict if the dict version
+   changed, and then compare values if the value of a key changed. The
+   keys are shared with other guards: a guard only compares its values if
+   the epoch of the watcher changed. */
+static int
+revalidate_dict_guard(GuardDictKeys *gkeys)
+{
+    DictWatcherObject *watcher = gkeys->watcher;
+    Py_ssize_t i;
+
+    if (dict_watcher_update(watcher) < 0)
+        return -1;
+
+    if (gkeys->epoch != watcher->epoch) {
+        assert(gkeys->npair >= 1);
+
+        for (i=0; i < gkeys->npair; i++) {
+            GuardDictPair *pair = &gkeys->pairs[i];
+
+            if (watcher->keys[pair->index].value != pair->value) {
+                /* the key was modified (removed or new value) */
+                return 2;
+            }
+        }
+
+        /* another key was modified, but watched keys are unchanged */
+        gkeys->epoch = watcher->epoch;
+    }
+
+    /* if the dict was modified during the revalidation, the version of the
+       watcher is older and the next check takes the slow path again */
+    gkeys->dict_version = watcher->dict_version;
+    return 0;
+}
+
+static int
+check_dict_guard(GuardDictObject *guard)
+{
+    if (unlikely(dict_guard_changed(&guard->keys))) {
+        GUARD_STAT_INC(&guard->base, nb_slow);
+        return revalidate_dict_guard(&guard->keys);
+    }
+
+    return 0;
+}
+
+static int
+guard_dict_check(PyObject *self, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
+{
+    GuardDictObject *guard = (GuardDictObject *)self;
+
+    return guard_count_check(&guard->base, check_dict_guard(guard));
+}
+
+static void
+guard_dict_dealloc(GuardDictObject *self)
+{
+    guard_dict_keys_clear(&self->keys);
+
+    PyFuncGuard_Type.tp_dealloc((PyObject *)self);
+}
+
+static int
+guard_dict_traverse(GuardDictObject *guard, visitproc visit, void *arg)
+{
+    return guard_dict_keys_traverse(&guard->keys, visit, arg);
+}
+
+static PyObject *
+guard_dict_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PyObject *op;
+    GuardDictObject *self;
+
+    op = PyFuncGuard_Type.tp_new(type, args, kwds);
+    if (op == NULL)
+        return NULL;
+
+    self = (GuardDictObject *)op;
+    self->base.base.check = guard_dict_check;
+    guard_dict_keys_init(&self->keys);
+    return op;
+}
+
+static int
+guard_dict_init_keys(GuardDictKeys *gkeys, PyObject *dict,
+                     Py_ssize_t first_key, PyObject *keys)
+{
+    DictWatcherObject *watcher = NULL;
+    GuardDictPair small_pairs[GUARD_DICT_SMALL];
+    GuardDictPair *pairs = small_pairs;
+    Py_ssize_t nkeys, i, npair = 0;
+
+    if (!PyTuple_Check(keys)) {
+        PyErr_Format(PyExc_TypeError,
+                     "keys must be a tuple of str, not %s",
+                     Py_TYPE(keys)->tp_name);
+        goto error;
+    }
+
+    nkeys = PyTuple_GET_SIZE(keys) - first_key;
+    if (nkeys <= 0) {
+        PyErr_SetString(PyExc_TypeError,
+                        "keys must at least contain one key");
+        goto error;
+    }
+
+    if (nkeys > GUARD_DICT_SMALL) {
+        if (nkeys > PY_SSIZE_T_MAX / (Py_ssize_t)sizeof(GuardDictPair)) {
+            PyErr_NoMemory();
+            goto error;
+        }
+        pairs = PyMem_Malloc(sizeof(GuardDictPair) * nkeys);
+        if (pairs == NULL) {
+            PyErr_NoMemory();
+            goto error;
+        }
+    }
+
+    watcher = dict_watcher_get(dict);
+    if (watcher == NULL)
+        goto error;
+
+    for (i=0; i < nkeys; i++) {
+        PyObject *key;
+        Py_ssize_t index;
+
+        key = PyTuple_GET_ITEM(keys, first_key + i);
+
+        if (!PyUnicode_Check(key)) {
+            PyErr_Format(PyExc_TypeError,
+                         "key must be str, not %s",
+                         Py_TYPE(key)->tp_name);
+            goto error;
+        }
+
+        /* Intern the key string */
+        Py_INCREF(key);
+        PyUnicode_InternInPlace(&key);
+
+        index = dict_watcher_add_key(watcher, key);
+        if (index < 0) {
+            Py_DECREF(key);
+            goto error;
+        }
+
+        pairs[npair].key = key;
+        pairs[npair].value = NULL;
+        pairs[npair].index = index;
+        npair++;
+    }
+
+    /* adding a key can revalidate other keys: get values at the end */
+    if (dict_watcher_update(watcher) < 0)
+        goto error;
+    for (i=0; i < npair; i++) {
+        pairs[i].value = watcher->keys[pairs[i].index].value;
+        Py_XINCREF(pairs[i].value);
+    }
+
+    guard_dict_keys_clear(gkeys);
+
+    if (pairs == small_pairs)
+        memcpy(gkeys->small_pairs, small_pairs, npair * sizeof(GuardDictPair));
+    else
+        gkeys->pairs = pairs;
+    Py_INCREF(dict);
+    gkeys->dict = dict;
+    Py_INCREF(dict);
+    gkeys->mapping = dict;
+    gkeys->watcher = watcher;
+    gkeys->dict_version = watcher->dict_version;
+    gkeys->epoch = watcher->epoch;
+    gkeys->npair = npair;
+    return 0;
+
+error:
+    for (i=0; i < npair; i++)
+        guard_dict_pair_dealloc(&pairs[i]);
+    if (pairs != small_pairs)
+        PyMem_Free(pairs);
+    Py_XDECREF(watcher);
+    return -1;
+}
+
+static int
+guard_dict_init(PyObject *op, PyObject *args, PyObject *kwargs)
+{
+    GuardDictObject *self = (GuardDictObject *)op;
+    PyObject *obj, *dict;
+
+    if (kwargs) {
+        PyErr_SetString(PyExc_TypeError,
+                        "keyword arguments are not supported");
+        return -1;
+    }
+    assert(PyTuple_Check(args));
+    if (PyTuple_GET_SIZE(args) == 0) {
+        PyErr_SetString(PyExc_TypeError, "missing dict parameter");
+        return -1;
+    }
+    obj = PyTuple_GET_ITEM(args, 0);
+    dict = guard_dict_unwrap(obj);
+    if (dict == NULL) {
+        PyErr_Format(PyExc_TypeError,
+                     "dict parameter must be dict or mappingproxy, got %s",
+                     Py_TYPE(obj)->tp_name);
+        return -1;
+    }
+
+    if (guard_dict_init_keys(&self->keys, dict, 1, args) < 0)
+        return -1;
+
+    /* don't expose the writable dict of a mappingproxy */
+    Py_INCREF(obj);
+    Py_SETREF(self->keys.mapping, obj);
+    return 0;
+}
+
+static PyObject*
+guard_dict_keys_tuple(GuardDictKeys *gkeys)
+{
+    PyObject *tuple;
+    Py_ssize_t i;
+
+    tuple = PyTuple_New(gkeys->npair);
+    if (tuple == NULL)
+        return NULL;
+
+    for (i=0; i < gkeys->npair; i++) {
+        GuardDictPair *pair = &gkeys->pairs[i];
+
+        Py_INCREF(pair->key);
+        PyTuple_SET_ITEM(tuple, i, pair->key);
+    }
+    return tuple;
+}
+
+static PyObject*
+guard_dict_get_keys(GuardDictObject *self)
+{
+    return guard_dict_keys_tuple(&self->keys);
+}
+
+static PyGetSetDef guard_dict_getsetlist[] = {
+    {"keys", (getter)guard_dict_get_keys},
+    {NULL} /* Sentinel */
+};
+
+static PyMemberDef guard_dict_members[] = {
+    {"dict",   T_OBJECT,   offsetof(GuardDictObject, keys.mapping),
+     RESTRICTED|READONLY},
+    GUARD_MEMBERS
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject GuardDict_Type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "fat.GuardDict",
+    sizeof(GuardDictObject),
+    0,
+    (destructor)guard_dict_dealloc,             /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    0,                                          /* tp_doc */
+    (traverseproc)guard_dict_traverse,          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    0,                                          /* tp_methods */
+    guard_dict_members,                         /* tp_members */
+    guard_dict_getsetlist,                      /* tp_getset */
+    &PyFuncGuard_Type,                          /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    guard_dict_init,                            /* tp_init */
+    0,                                          /* tp_alloc */
+    guard_dict_new,                             /* tp_new */
+    0,                                          /* tp_free */
+};
+
+
+/* GuardGlobals */
+
+static int
+check_globals_guard(GuardDictObject *guard)
+{
+    PyThreadState *tstate;
+    PyFrameObject *frame;
+
+    tstate = PyThreadState_GET();
+    assert(tstate != NULL);
+
+    frame = tstate->frame;
+    assert(frame != NULL);
+
+    /* If the frame globals dictionary is different than the frame globals
+     * dictionary used to create the guard, the guard check fails */
+    if (unlikely(frame->f_globals != guard->keys.dict))
+        return 2;
+
+    return check_dict_guard(guard);
+}
+
+static int
+guard_globals_check(PyObject *self, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
+{
+    GuardDictObject *guard = (GuardDictObject *)self;
+
+    return guard_count_check(&guard->base, check_globals_guard(guard));
+}
+
+static PyObject *
+guard_globals_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PyObject *op;
+    GuardDictObject *self;
+
+    op = GuardDict_Type.tp_new(type, args, kwds);
+    if (op == NULL)
+        return NULL;
+
+    self = (GuardDictObject *)op;
+    self->base.base.check = guard_globals_check;
+
+    return op;
+}
+
+static int
+guard_globals_init(PyObject *op, PyObject *args, PyObject *kwargs)
+{
+    PyObject *globals, *keys;
+
+    if (kwargs) {
+        PyErr_SetString(PyExc_TypeError,
+                        "keyword arguments are not supported");
+        return -1;
+    }
+    keys = args;
+
+    globals = PyEval_GetGlobals();
+    if (globals == NULL) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "unable to get globals");
+        return -1;
+    }
+
+    return guard_dict_init_keys(&((GuardDictObject *)op)->keys,
+                                globals, 0, keys);
+}
+
+
+PyDoc_STRVAR(guard_globals_doc,
+"GuardGlobals(keys)\n"
+"\n"
+"Guard on globals()[key] for all keys.");
+
+static PyTypeObject GuardGlobals_Type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "fat.GuardGlobals",
+    sizeof(GuardDictObject),
+    0,
+    0,                                          /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    guard_globals_doc,                          /* tp_doc */
+    (traverseproc)guard_dict_traverse,          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    0,                                          /* tp_methods */
+    0,                                          /* tp_members */
+    0,                                          /* tp_getset */
+    &GuardDict_Type,                            /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    guard_globals_init,                        /* tp_init */
+    0,                                          /* tp_alloc */
+    guard_globals_new,                         /* tp_new */
+    0,                                          /* tp_free */
+};
+
+
+/* GuardBuiltins */
+
+/* Watcher of the interpreter builtins, watching all keys of init_builtins.
+   Created by fat_init_builtins() and kept until the process exit. */
+static DictWatcherObject *builtins_watcher = NULL;
+/* number of keys of init_builtins: first keys of builtins_watcher */
+static Py_ssize_t builtins_nkey = 0;
+/* epoch of builtins_watcher when builtins were last found unchanged
+   compared to init_builtins */
+static PY_UINT64_T builtins_epoch = 0;
+/* epoch of builtins_watcher when builtins were last found modified: the
+   epoch only changes when a watched value changes, so init_builtins is
+   only scanned once per epoch while a builtin stays modified */
+static PY_UINT64_T builtins_modified_epoch = 0;
+
+typedef struct {
+    GuardDictObject base;
+    int init_failed;
+    /* 1 if the guard only watches keys of init_builtins in the
+       interpreter builtins */
+    int init_only;
+    /* keys of the frame globals, the guard fails if a key is created */
+    GuardDictKeys globals;
+    /* GuardGlobals object created at the first access to the guard_globals
+       attribute, NULL before */
+    PyObject *guard_globals;
+} GuardBuiltinsObject;
+
+/* Slow path of builtins_unmodified() */
+static int
+revalidate_builtins(void)
+{
+    DictWatcherObject *watcher = builtins_watcher;
+    Py_ssize_t i;
+
+    if (dict_watcher_update(watcher) < 0)
+        return -1;
+
+    if (watcher->epoch == builtins_epoch)
+        return 1;
+    if (watcher->epoch == builtins_modified_epoch)
+        return 0;
+
+    for (i=0; i < builtins_nkey; i++) {
+        WatchedKey *wk = &watcher->keys[i];
+        PyObject *init_value;
+
+        init_value = PyDict_GetItemWithError(init_builtins, wk->key);
+        if (init_value == NULL && PyErr_Occurred())
+            return -1;
+
+        if (wk->value != init_value) {
+            builtins_modified_epoch = watcher->epoch;
+            return 0;
+        }
+    }
+
+    /* builtins were modified and then restored */
+    builtins_epoch = watcher->epoch;
+    return 1;
+}
+
+/* Check if all keys of init_builtins still have their initial value in the
+   interpreter builtins. Return 1 if unmodified, 0 if modified, -1 on
+   error. */
+static inline int
+builtins_unmodified(void)
+{
+    DictWatcherObject *watcher = builtins_watcher;
+
+    if (unlikely(DICT_VERSION(watcher->dict) != watcher->dict_version))
+        return revalidate_builtins();
+    if (unlikely(watcher->epoch != builtins_epoch))
+        return revalidate_builtins();
+    return 1;
+}
+
+static void
+guard_builtins_dealloc(GuardBuiltinsObject *self)
+{
+    guard_dict_keys_clear(&self->globals);
+    Py_XDECREF(self->guard_globals);
+    guard_dict_dealloc(&self->base);
+}
+
+static int
+guard_builtins_init_guard(PyObject *self, PyObject *func)
+{
+    GuardBuiltinsObject *guard = (GuardBuiltinsObject *)self;
+    Py_ssize_t i;
+    PyObject *init_value;
+    int init_only;
+
+    assert(init_builtins != NULL);
+    init_only = (guard->base.keys.watcher == builtins_watcher);
+    for (i=0; i < guard->base.keys.npair; i++) {
+        PyObject *name = guard->base.keys.pairs[i].key;
+
+        init_value = PyDict_GetItem(init_builtins, name);
+        if (init_value != NULL) {
+            if (guard->base.keys.pairs[i].value != init_value) {
+                /* builtin was modified since Python initialization:
+                   don't specialize the function */
+                guard->init_failed = 1;
+                return 1;
+            }
+        }
+        else
+            init_only = 0;
+        PyErr_Clear();
+    }
+
+    for (i=0; i < guard->globals.npair; i++) {
+        if (guard->globals.pairs[i].value != NULL) {
+            /* if name already exists in global, the guard must fail */
+            guard->init_failed = 1;
+            return 1;
+        }
+    }
+
+    guard->init_only = init_only;
+    guard->init_failed = 0;
+    return 0;
+}
+
+static int
+check_builtins_guard(GuardBuiltinsObject *guard)
+{
+    PyObject *self = (PyObject *)guard;
+    PyThreadState* tstate;
+    PyFrameObject *frame;
+    int res;
+
+    if (unlikely(guard->init_failed == -1)) {
+        guard_builtins_init_guard(self, NULL);
+        assert(guard->init_failed != -1);
+    }
+
+    if (unlikely(guard->init_failed))
+        return 2;
+
+    tstate = PyThreadState_GET();
+    assert(tstate != NULL);
+
+    frame = tstate->frame;
+    if (frame == NULL) {
+        /* Python is probably being finalized */
+        return 2;
+    }
+
+    /* If the frame globals dictionary is different than the frame globals
+     * dictionary used to create the guard, the guard check fails */
+    if (unlikely(frame->f_globals != guard->globals.dict)) {
+        return 2;
+    }
+
+    /* If the builtin dictionary of the current frame is different than the
+     * builtin dictionary used to create the guard, the guard check fails */
+    if (unlikely(frame->f_builtins != guard->base.keys.dict)) {
+        return 2;
+    }
+
+    if (unlikely(dict_guard_changed(&guard->globals))) {
+        GUARD_STAT_INC(&guard->base.base, nb_slow);
+
+        res = revalidate_dict_guard(&guard->globals);
+        if (unlikely(res)) {
+            return res;
+        }
+    }
+
+    /* Fast path: builtins are unchanged since Python initialization */
+    if (likely(guard->init_only)) {
+        res = builtins_unmodified();
+        if (unlikely(res < 0))
+            return -1;
+        if (likely(res))
+            return 0;
+    }
+
+    if (unlikely(dict_guard_changed(&guard->base.keys))) {
+        GUARD_STAT_INC(&guard->base.base, nb_slow);
+        return revalidate_dict_guard(&guard->base.keys);
+    }
+
+    return 0;
+}
+
+static int
+guard_builtins_check(PyObject *self, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
+{
+    GuardBuiltinsObject *guard = (GuardBuiltinsObject *)self;
+
+    return guard_count_check(&guard->base.base, check_builtins_guard(guard));
+}
+
+static PyObject *
+guard_builtins_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PyObject *op;
+    GuardBuiltinsObject *self;
+
+    op = GuardDict_Type.tp_new(type, args, kwds);
+    if (op == NULL)
+        return NULL;
+
+    self = (GuardBuiltinsObject *)op;
+    self->base.base.base.init = guard_builtins_init_guard;
+    self->base.base.base.check = guard_builtins_check;
+    self->init_failed = -1;
+    self->init_only = 0;
+    guard_dict_keys_init(&self->globals);
+    self->guard_globals = NULL;
+
+    return op;
+}
+
+static int
+guard_builtins_init(PyObject *op, PyObject *args, PyObject *kwargs)
+{
+    GuardBuiltinsObject *self = (GuardBuiltinsObject *)op;
+    PyObject *builtins, *globals, *keys;
+
+    if (kwargs) {
+        PyErr_SetString(PyExc_TypeError,
+                        "keyword arguments are not supported");
+        return -1;
+    }
+    keys = args;
+
+    builtins = PyEval_GetBuiltins();
+    if (builtins == NULL) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "unable to get builtins");
+        return -1;
+    }
+
+    if (!PyDict_Check(builtins)) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "frame builtins is not a dict");
+        return -1;
+    }
+
+    globals = PyEval_GetGlobals();
+    if (globals == NULL) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "unable to get globals");
+        return -1;
+    }
+
+    /* keys of the globals are stored in the guard, rather than in a
+       nested GuardGlobals object, to avoid a second object allocation */
+    Py_CLEAR(self->guard_globals);
+    if (guard_dict_init_keys(&self->globals, globals, 0, keys) < 0)
+        return -1;
+
+    return guard_dict_init_keys(&self->base.keys, builtins, 0, keys);
+}
+
+static int
+guard_builtins_traverse(GuardBuiltinsObject *self, visitproc visit, void *arg)
+{
+    int res = guard_dict_traverse((GuardDictObject *)self, visit, arg);
+    if (res)
+        return res;
+    Py_VISIT(self->guard_globals);
+    return guard_dict_keys_traverse(&self->globals, visit, arg);
+}
+
+/* Get the GuardGlobals guard watching the globals keys of the guard,
+   create it at the first call */
+static PyObject*
+guard_builtins_get_guard_globals(GuardBuiltinsObject *self)
+{
+    PyObject *op;
+
+    if (self->globals.dict == NULL)
+        Py_RETURN_NONE;
+
+    if (self->guard_globals == NULL) {
+        op = GuardGlobals_Type.tp_new(&GuardGlobals_Type, NULL, NULL);
+        if (op == NULL)
+            return NULL;
+
+        if (guard_dict_keys_copy(&((GuardDictObject *)op)->keys,
+                                 &self->globals) < 0) {
+            Py_DECREF(op);
+            return NULL;
+        }
+        self->guard_globals = op;
+    }
+
+    Py_INCREF(self->guard_globals);
+    return self->guard_globals;
+}
+
+static PyGetSetDef guard_builtins_getsetlist[] = {
+    {"guard_globals", (getter)guard_builtins_get_guard_globals, NULL, NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject GuardBuiltins_Type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "fat.GuardBuiltins",
+    sizeof(GuardBuiltinsObject),
+    0,
+    (destructor)guard_builtins_dealloc,         /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    0,                                          /* tp_doc */
+    (traverseproc)guard_builtins_traverse,      /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    0,                                          /* tp_methods */
+    0,                                          /* tp_members */
+    guard_builtins_getsetlist,                  /* tp_getset */
+    &GuardDict_Type,                            /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    guard_builtins_init,                        /* tp_init */
+    0,                                          /* tp_alloc */
+    guard_builtins_new,                         /* tp_new */
+    0,                                          /* tp_free */
+};
+
+
+/* GuardFrozenDict */
+
+typedef struct {
+    GuardDictObject base;
+    /* version of the dict when the guard was created */
+    PY_UINT64_T dict_version;
+    /* 1 until the dict is modified, 0 in per-key mode */
+    int frozen;
+    /* if non-zero, fall back to per-key mode when the dict is modified */
+    int fallback;
+} GuardFrozenDictObject;
+
+static int
+check_frozen_dict_guard(GuardFrozenDictObject *guard)
+{
+    if (likely(guard->frozen)) {
+        if (likely(DICT_VERSION(guard->base.keys.dict) == guard->dict_version))
+            return 0;
+
+        if (!guard->fallback)
+            return 2;
+
+        /* first modification of the dict: watch keys from now */
+        guard->frozen = 0;
+    }
+
+    return check_dict_guard(&guard->base);
+}
+
+static int
+guard_frozen_dict_check(PyObject *self, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
+{
+    GuardFrozenDictObject *guard = (GuardFrozenDictObject *)self;
+
+    return guard_count_check(&guard->base.base,
+                             check_frozen_dict_guard(guard));
+}
+
+static PyObject *
+guard_frozen_dict_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PyObject *op;
+    GuardFrozenDictObject *self;
+
+    op = GuardDict_Type.tp_new(type, args, kwds);
+    if (op == NULL)
+        return NULL;
+
+    self = (GuardFrozenDictObject *)op;
+    self->base.base.base.check = guard_frozen_dict_check;
+    self->dict_version = 0;
+    self->frozen = 1;
+    self->fallback = 0;
+
+    return op;
+}
+
+static int
+guard_frozen_dict_init(PyObject *op, PyObject *args, PyObject *kwargs)
+{
+    GuardFrozenDictObject *self = (GuardFrozenDictObject *)op;
+    GuardDictKeys *gkeys = &self->base.keys;
+    PyObject *obj, *dict;
+    int fallback = 0;
+
+    if (kwargs != NULL && PyDict_Size(kwargs) != 0) {
+        PyObject *value = PyDict_GetItemString(kwargs, "fallback");
+
+        if (value == NULL || PyDict_Size(kwargs) != 1) {
+            PyErr_SetString(PyExc_TypeError,
+                            "fallback is the only keyword argument");
+            return -1;
+        }
+        fallback = PyObject_IsTrue(value);
+        if (fallback < 0)
+            return -1;
+    }
+
+    assert(PyTuple_Check(args));
+    if (PyTuple_GET_SIZE(args) == 0) {
+        PyErr_SetString(PyExc_TypeError, "missing dict parameter");
+        return -1;
+    }
+    obj = PyTuple_GET_ITEM(args, 0);
+    dict = guard_dict_unwrap(obj);
+    if (dict == NULL) {
+        PyErr_Format(PyExc_TypeError,
+                     "dict parameter must be dict or mappingproxy, got %s",
+                     Py_TYPE(obj)->tp_name);
+        return -1;
+    }
+
+    if (fallback) {
+        if (PyTuple_GET_SIZE(args) == 1) {
+            PyErr_SetString(PyExc_ValueError,
+                            "fallback requires at least one key");
+            return -1;
+        }
+
+        /* keys are only watched in per-key mode */
+        if (guard_dict_init_keys(gkeys, dict, 1, args) < 0)
+            return -1;
+    }
+    else {
+        if (PyTuple_GET_SIZE(args) > 1) {
+            PyErr_SetString(PyExc_ValueError,
+                            "keys require fallback=True");
+            return -1;
+        }
+
+        /* no key: only compare the version of the whole dict, no
+           watcher is needed */
+        guard_dict_keys_clear(gkeys);
+        Py_INCREF(dict);
+        gkeys->dict = dict;
+    }
+
+    /* don't expose the writable dict of a mappingproxy */
+    Py_INCREF(obj);
+    Py_XSETREF(gkeys->mapping, obj);
+
+    self->dict_version = DICT_VERSION(gkeys->dict);
+    self->frozen = 1;
+    self->fallback = fallback;
+    return 0;
+}
+
+static PyMemberDef guard_frozen_dict_members[] = {
+    {"frozen",   T_INT,   offsetof(GuardFrozenDictObject, frozen),
+     RESTRICTED|READONLY},
+    {"fallback",   T_INT,   offsetof(GuardFrozenDictObject, fallback),
+     RESTRICTED|READONLY},
+    {NULL}  /* Sentinel */
+};
+
+PyDoc_STRVAR(guard_frozen_dict_doc,
+"GuardFrozenDict(dict)\n"
+"GuardFrozenDict(dict, *keys, fallback=True)\n"
+"\n"
+"Guard on a dict which must not be modified, like the namespace of a\n"
+"configuration module or a constant table: the check only compares the\n"
+"version of the whole dict.\n"
+"\n"
+"The guard fails at the first modification of the dict. If fallback is\n"
+"true, the guard watches dict[key] for all keys instead after the first\n"
+"modification, as GuardDict. Keys are only accepted with fallback.");
+
+static PyTypeObject GuardFrozenDict_Type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "fat.GuardFrozenDict",
+    sizeof(GuardFrozenDictObject),
+    0,
+    0,                                          /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    guard_frozen_dict_doc,                      /* tp_doc */
+    (traverseproc)guard_dict_traverse,          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    0,                                          /* tp_methods */
+    guard_frozen_dict_members,                  /* tp_members */
+    0,                                          /* tp_getset */
+    &GuardDict_Type,                            /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    guard_frozen_dict_init,                     /* tp_init */
+    0,                                          /* tp_alloc */
+    guard_frozen_dict_new,                      /* tp_new */
+    0,                                          /* tp_free */
+};
+
+
+/* GuardModuleAttr */
+
+typedef struct {
+    GuardObject base;
+    /* dotted name, ex: "os.path.join" */
+    PyObject *name;
+    /* one hop per part of the name: hops[0] watches the key in the globals,
+       hops[i] watches the key in the dict of the module of hops[i-1] */
+    Py_ssize_t nhop;
+    GuardDictKeys *hops;
+} GuardModuleAttrObject;
+
+static int
+check_module_attr_guard(GuardModuleAttrObject *guard)
+{
+    PyThreadState *tstate;
+    PyFrameObject *frame;
+    Py_ssize_t i;
+    int res;
+
+    tstate = PyThreadState_GET();
+    assert(tstate != NULL);
+
+    frame = tstate->frame;
+    assert(frame != NULL);
+
+    /* If the frame globals dictionary is different than the frame globals
+     * dictionary used to create the guard, the guard check fails */
+    if (unlikely(frame->f_globals != guard->hops[0].dict))
+        return 2;
+
+    for (i=0; i < guard->nhop; i++) {
+        GuardDictKeys *hop = &guard->hops[i];
+
+        if (unlikely(dict_guard_changed(hop))) {
+            GUARD_STAT_INC(&guard->base, nb_slow);
+
+            res = revalidate_dict_guard(hop);
+            if (unlikely(res))
+                return res;
+        }
+    }
+    return 0;
+}
+
+static int
+guard_module_attr_check(PyObject *self, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
+{
+    GuardModuleAttrObject *guard = (GuardModuleAttrObject *)self;
+
+    return guard_count_check(&guard->base, check_module_attr_guard(guard));
+}
+
+static void
+guard_module_attr_clear(GuardModuleAttrObject *self)
+{
+    Py_ssize_t i;
+
+    for (i=0; i < self->nhop; i++)
+        guard_dict_keys_clear(&self->hops[i]);
+    PyMem_Free(self->hops);
+    self->hops = NULL;
+    self->nhop = 0;
+    Py_CLEAR(self->name);
+}
+
+static void
+guard_module_attr_dealloc(GuardModuleAttrObject *self)
+{
+    guard_module_attr_clear(self);
+
+    PyFuncGuard_Type.tp_dealloc((PyObject *)self);
+}
+
+static int
+guard_module_attr_traverse(GuardModuleAttrObject *self, visitproc visit, void *arg)
+{
+    Py_ssize_t i;
+    int res;
+
+    Py_VISIT(self->name);
+    for (i=0; i < self->nhop; i++) {
+        res = guard_dict_keys_traverse(&self->hops[i], visit, arg);
+        if (res)
+            return res;
+    }
+    return 0;
+}
+
+static PyObject *
+guard_module_attr_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PyObject *op;
+    GuardModuleAttrObject *self;
+
+    op = PyFuncGuard_Type.tp_new(type, args, kwds);
+    if (op == NULL)
+        return NULL;
+
+    self = (GuardModuleAttrObject *)op;
+    self->base.base.check = guard_module_attr_check;
+    self->name = NULL;
+    self->nhop = 0;
+    self->hops = NULL;
+
+    return op;
+}
+
+static int
+guard_module_attr_init(PyObject *op, PyObject *args, PyObject *kwargs)
+{
+    GuardModuleAttrObject *self = (GuardModuleAttrObject *)op;
+    static char *keywords[] = {"name", NULL};
+    PyObject *name, *sep, *parts, *dict;
+    GuardDictKeys *hops = NULL;
+    Py_ssize_t nhop = 0, nparts, i;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "U:GuardModuleAttr",
+                                     keywords, &name))
+        return -1;
+
+    dict = PyEval_GetGlobals();
+    if (dict == NULL) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "unable to get globals");
+        return -1;
+    }
+
+    sep = PyUnicode_FromString(".");
+    if (sep == NULL)
+        return -1;
+    parts = PyUnicode_Split(name, sep, -1);
+    Py_DECREF(sep);
+    if (parts == NULL)
+        return -1;
+
+    nparts = PyList_GET_SIZE(parts);
+    if (nparts < 2) {
+        PyErr_Format(PyExc_ValueError,
+                     "name must be a dotted name like 'module.attr', "
+                     "got %R", name);
+        goto error;
+    }
+
+    hops = PyMem_Malloc(sizeof(GuardDictKeys) * nparts);
+    if (hops == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+
+    for (i=0; i < nparts; i++) {
+        PyObject *part = PyList_GET_ITEM(parts, i);
+        PyObject *key, *value;
+        int res;
+
+        if (PyUnicode_GET_LENGTH(part) == 0) {
+            PyErr_Format(PyExc_ValueError, "invalid name: %R", name);
+            goto error;
+        }
+
+        key = PyTuple_Pack(1, part);
+        if (key == NULL)
+            goto error;
+
+        guard_dict_keys_init(&hops[i]);
+        nhop++;
+        res = guard_dict_init_keys(&hops[i], dict, 0, key);
+        Py_DECREF(key);
+        if (res < 0)
+            goto error;
+
+        value = hops[i].pairs[0].value;
+        if (value == NULL) {
+            PyErr_Format(PyExc_ValueError,
+                         "%R doesn't exist", part);
+            goto error;
+        }
+
+        if (i == nparts - 1)
+            break;
+
+        if (!PyModule_Check(value)) {
+            PyErr_Format(PyExc_TypeError,
+                         "%R must be a module, not %s",
+                         part, Py_TYPE(value)->tp_name);
+            goto error;
+        }
+        dict = PyModule_GetDict(value);
+    }
+    Py_CLEAR(parts);
+
+    guard_module_attr_clear(self);
+    Py_INCREF(name);
+    self->name = name;
+    self->nhop = nhop;
+    self->hops = hops;
+    return 0;
+
+error:
+    for (i=0; i < nhop; i++)
+        guard_dict_keys_clear(&hops[i]);
+    PyMem_Free(hops);
+    Py_XDECREF(parts);
+    return -1;
+}
+
+static PyObject*
+guard_module_attr_get_value(GuardModuleAttrObject *self)
+{
+    PyObject *value;
+
+    if (self->nhop == 0)
+        Py_RETURN_NONE;
+
+    value = self->hops[self->nhop - 1].pairs[0].value;
+    Py_INCREF(value);
+    return value;
+}
+
+static PyGetSetDef guard_module_attr_getsetlist[] = {
+    {"value", (getter)guard_module_attr_get_value, NULL, NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyMemberDef guard_module_attr_members[] = {
+    {"name",   T_OBJECT,   offsetof(GuardModuleAttrObject, name),
+     RESTRICTED|READONLY},
+    GUARD_MEMBERS
+    {NULL}  /* Sentinel */
+};
+
+PyDoc_STRVAR(guard_module_attr_doc,
+"GuardModuleAttr(name)\n"
+"\n"
+"Guard on a dotted name like 'math.sqrt' or 'os.path.join': the first\n"
+"part is looked up in globals(), the next parts in the namespace of the\n"
+"module of the previous part. The guard fails if a name of the chain is\n"
+"replaced.\n"
+"\n"
+"The value attribute is the value of the last name when the guard was\n"
+"created.");
+
+static PyTypeObject GuardModuleAttr_Type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "fat.GuardModuleAttr",
+    sizeof(GuardModuleAttrObject),
+    0,
+    (destructor)guard_module_attr_dealloc,      /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    guard_module_attr_doc,                      /* tp_doc */
+    (traverseproc)guard_module_attr_traverse,   /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    0,                                          /* tp_methods */
+    guard_module_attr_members,                  /* tp_members */
+    guard_module_attr_getsetlist,               /* tp_getset */
+    &PyFuncGuard_Type,                          /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    guard_module_attr_init,                     /* tp_init */
+    0,                                          /* tp_alloc */
+    guard_module_attr_new,                      /* tp_new */
+    0,                                          /* tp_free */
+};
+
+
+/* GuardInstanceLayout */
+
+typedef struct {
+    GuardObject base;
+    GuardArg arg;
+    PyObject *type;
+    unsigned int version_tag;
+    /* shared keys of the instance dictionaries (strong reference) */
+    PyDictKeysObject *dict_keys;
+} GuardInstanceLayoutObject;
+
+/* Get the split-keys dictionary of an instance, or NULL */
+static PyDictObject*
+get_split_instance_dict(PyObject *obj)
+{
+    PyObject **dictptr;
+    PyDictObject *dict;
+
+    dictptr = _PyObject_GetDictPtr(obj);
+    if (dictptr == NULL || *dictptr == NULL)
+        return NULL;
+
+    dict = (PyDictObject *)*dictptr;
+    if (!PyDict_CheckExact(dict) || dict->ma_values == NULL)
+        return NULL;
+    return dict;
+}
+
+static int
+guard_instance_layout_init_guard(PyObject *self, PyObject *func)
+{
+    GuardInstanceLayoutObject *guard = (GuardInstanceLayoutObject *)self;
+
+    return guard_arg_bind(&guard->arg, func);
+}
+
+static int
+check_instance_layout_guard(GuardInstanceLayoutObject *guard, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyTypeObject *type = (PyTypeObject *)guard->type;
+    PyObject *obj;
+    PyObject **dictptr;
+    PyDictObject *dict;
+
+    /* the type or one of its base classes was modified */
+    if (unlikely(type->tp_version_tag != guard->version_tag
+                 || !PyType_HasFeature(type, Py_TPFLAGS_VALID_VERSION_TAG)))
+        return 2;
+
+    if (guard_arg_get(&guard->arg, stack, nargs, kwnames, &obj))
+        return 1;
+
+    if (Py_TYPE(obj) != type)
+        return 1;
+
+    dictptr = _PyObject_GetDictPtr(obj);
+    if (dictptr == NULL || *dictptr == NULL)
+        return 1;
+
+    /* the dictionary of the instance was converted to a combined table,
+       or it uses other shared keys */
+    dict = (PyDictObject *)*dictptr;
+    if (dict->ma_keys != guard->dict_keys)
+        return 1;
+
+    return 0;
+}
+
+static int
+guard_instance_layout_check(PyObject *self, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
+{
+    GuardInstanceLayoutObject *guard = (GuardInstanceLayoutObject *)self;
+
+    return guard_count_check(&guard->base,
+                             check_instance_layout_guard(guard, stack, nargs, kwnames));
+}
+
+static void
+guard_instance_layout_dealloc(GuardInstanceLayoutObject *self)
+{
+    Py_XDECREF(self->type);
+    if (self->dict_keys != NULL)
+        DK_DECREF(self->dict_keys);
+    guard_arg_clear(&self->arg);
+
+    PyFuncGuard_Type.tp_dealloc((PyObject *)self);
+}
+
+static int
+guard_instance_layout_traverse(GuardInstanceLayoutObject *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->type);
+    return guard_arg_traverse(&self->arg, visit, arg);
+}
+
+static PyObject *
+guard_instance_layout_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PyObject *op;
+    GuardInstanceLayoutObject *self;
+
+    op = PyFuncGuard_Type.tp_new(type, args, kwds);
+    if (op == NULL)
+        return NULL;
+
+    self = (GuardInstanceLayoutObject *)op;
+    self->base.base.init = guard_instance_layout_init_guard;
+    self->base.base.check = guard_instance_layout_check;
+    guard_arg_init(&self->arg, 0);
+    self->type = NULL;
+    self->version_tag = 0;
+    self->dict_keys = NULL;
+
+    return op;
+}
+
+static int
+guard_instance_layout_init(PyObject *op, PyObject *args, PyObject *kwargs)
+{
+    GuardInstanceLayoutObject *self = (GuardInstanceLayoutObject *)op;
+    static char *keywords[] = {"arg_index", "obj", NULL};
+    int arg_index;
+    PyObject *obj, *type;
+    PyDictObject *dict;
+    PyDictKeysObject *old_keys;
+    unsigned int version_tag;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "iO:GuardInstanceLayout",
+                                     keywords, &arg_index, &obj))
+        return -1;
+    if (guard_arg_check_index(arg_index) < 0)
+        return -1;
+
+    type = (PyObject *)Py_TYPE(obj);
+
+    dict = get_split_instance_dict(obj);
+    if (dict == NULL) {
+        PyErr_Format(PyExc_ValueError,
+                     "%s instance has no split-keys dictionary",
+                     ((PyTypeObject *)type)->tp_name);
+        return -1;
+    }
+
+    version_tag = type_version_tag((PyTypeObject *)type);
+    if (version_tag == 0) {
+        PyErr_Format(PyExc_ValueError,
+                     "unable to get a version tag of the type %s",
+                     ((PyTypeObject *)type)->tp_name);
+        return -1;
+    }
+
+    Py_XDECREF(self->type);
+    old_keys = self->dict_keys;
+
+    guard_arg_reset(&self->arg, arg_index);
+    Py_INCREF(type);
+    self->type = type;
+    self->version_tag = version_tag;
+    /* only keep the keys alive, not the attribute values */
+    DK_INCREF(dict->ma_keys);
+    self->dict_keys = dict->ma_keys;
+    if (old_keys != NULL)
+        DK_DECREF(old_keys);
+    return 0;
+}
+
+static PyMemberDef guard_instance_layout_members[] = {
+    {"arg_index",   T_PYSSIZET,   offsetof(GuardInstanceLayoutObject, arg.arg_index),
+     RESTRICTED|READONLY},
+    {"arg_name",   T_OBJECT,   offsetof(GuardInstanceLayoutObject, arg.name),
+     RESTRICTED|READONLY},
+    {"type",   T_OBJECT,   offsetof(GuardInstanceLayoutObject, type),
+     RESTRICTED|READONLY},
+    GUARD_MEMBERS
+    {NULL}  /* Sentinel */
+};
+
+PyDoc_STRVAR(guard_instance_layout_doc,
+"GuardInstanceLayout(arg_index, obj)\n"
+"\n"
+"Guard on the layout of a function argument: the argument must have the\n"
+"same type as obj, the type must not be modified, and the instance\n"
+"dictionary must share its keys with the dictionary of obj.\n"
+"\n"
+"Attributes can then be read at the index given by attr_index().");
+
+static PyTypeObject GuardInstanceLayout_Type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "fat.GuardInstanceLayout",
+    sizeof(GuardInstanceLayoutObject),
+    0,
+    (destructor)guard_instance_layout_dealloc,  /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    guard_instance_layout_doc,                  /* tp_doc */
+    (traverseproc)guard_instance_layout_traverse, /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    0,                                          /* tp_methods */
+    guard_instance_layout_members,              /* tp_members */
+    0,                                          /* tp_getset */
+    &PyFuncGuard_Type,                          /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    guard_instance_layout_init,                 /* tp_init */
+    0,                                          /* tp_alloc */
+    guard_instance_layout_new,                  /* tp_new */
+    0,                                          /* tp_free */
+};
+
+
+/* GuardChain */
+
+/* Cost classes of guard checks: a cheap check is run first */
+#define GUARD_COST_ARG 1
+#define GUARD_COST_OBJECT 2
+#define GUARD_COST_DICT 4
+#define GUARD_COST_BUILTINS 8
+#define GUARD_COST_UNKNOWN 16
+
+/* default number of checks between two reorders of a chain */
+#define GUARD_CHAIN_REORDER_PERIOD 1000
+
+typedef struct {
+    PyObject *guard;
+    Py_ssize_t cost;
+    /* decaying number of checks and failures of the guard in the chain */
+    Py_ssize_t nb_check;
+    Py_ssize_t nb_fail;
+} GuardChainEntry;
+
+typedef struct {
+    GuardObject base;
+    Py_ssize_t nguard;
+    /* guards in the order of the checks */
+    GuardChainEntry *entries;
+    /* number of checks between two reorders, 0 to never reorder */
+    Py_ssize_t reorder_period;
+    /* number of checks until the next reorder */
+    Py_ssize_t reorder_countdown;
+    /* number of checks in progress: a guard of the chain can execute
+       arbitrary code which checks the chain again */
+    Py_ssize_t nesting;
+    /* if non-zero, reorder at the end of the outermost check */
+    int reorder_pending;
+} GuardChainObject;
+
+static PyTypeObject GuardChain_Type;
+
+/* Get the static cost class of a guard check */
+static Py_ssize_t
+guard_chain_cost(PyObject *guard)
+{
+    PyTypeObject *type = Py_TYPE(guard);
+
+    if (type == &GuardArgType_Type
+        || type == &GuardArgValue_Type
+        || type == &GuardArgRange_Type
+        || type == &GuardArgShape_Type)
+        return GUARD_COST_ARG;
+    if (type == &GuardSignature_Type
+        || type == &GuardTypeDispatch_Type
+        || type == &GuardFunc_Type
+        || type == &GuardTypeVersion_Type
+        || type == &GuardInstanceLayout_Type
+        || type == &GuardFrozenDict_Type)
+        return GUARD_COST_OBJECT;
+    if (type == &GuardDict_Type
+        || type == &GuardGlobals_Type)
+        return GUARD_COST_DICT;
+    if (type == &GuardModuleAttr_Type)
+        return GUARD_COST_DICT * ((GuardModuleAttrObject *)guard)->nhop;
+    if (type == &GuardBuiltins_Type)
+        return GUARD_COST_BUILTINS;
+    if (type == &GuardChain_Type) {
+        GuardChainObject *chain = (GuardChainObject *)guard;
+        Py_ssize_t i, cost = 0;
+
+        for (i=0; i < chain->nguard; i++)
+            cost += chain->entries[i].cost;
+        return cost;
+    }
+    return GUARD_COST_UNKNOWN;
+}
+
+/* Return 1 if the guard a must be checked before b: order guards by
+   cost / failure rate, the cheapest and likeliest-to-fail first */
+static int
+guard_chain_before(GuardChainEntry *a, GuardChainEntry *b)
+{
+    double score_a, score_b;
+
+    score_a = (double)a->cost * (a->nb_check + 1) / (a->nb_fail + 1);
+    score_b = (double)b->cost * (b->nb_check + 1) / (b->nb_fail + 1);
+    return (score_a < score_b);
+}
+
+/* Stable insertion sort: chains are short */
+static void
+guard_chain_reorder(GuardChainObject *guard)
+{
+    Py_ssize_t i, j;
+
+    for (i=1; i < guard->nguard; i++) {
+        GuardChainEntry entry = guard->entries[i];
+
+        for (j=i; j > 0 && guard_chain_before(&entry, &guard->entries[j-1]); j--)
+            guard->entries[j] = guard->entries[j-1];
+        guard->entries[j] = entry;
+    }
+
+    /* decay counters to adapt the order to recent checks */
+    for (i=0; i < guard->nguard; i++) {
+        guard->entries[i].nb_check >>= 1;
+        guard->entries[i].nb_fail >>= 1;
+    }
+    guard->reorder_countdown = guard->reorder_period;
+    guard->reorder_pending = 0;
+}
+
+static int
+guard_chain_init_guard(PyObject *self, PyObject *func)
+{
+    GuardChainObject *guard = (GuardChainObject *)self;
+    Py_ssize_t i;
+    int res;
+
+    for (i=0; i < guard->nguard; i++) {
+        PyFuncGuardObject *item = (PyFuncGuardObject *)guard->entries[i].guard;
+
+        res = item->init((PyObject *)item, func);
+        if (res)
+            return res;
+    }
+    return 0;
+}
+
+static int
+check_chain_guard(GuardChainObject *guard, PyObject **stack, Py_ssize_t nargs,
+                  PyObject *kwnames)
+{
+    Py_ssize_t i;
+    int res = 0;
+
+    if (guard->reorder_period != 0 && --guard->reorder_countdown <= 0)
+        guard->reorder_pending = 1;
+
+    /* entries must not be reordered nor replaced while they are checked,
+       and the chain must stay alive until the end of the check */
+    Py_INCREF(guard);
+    guard->nesting++;
+
+    for (i=0; i < guard->nguard; i++) {
+        GuardChainEntry *entry = &guard->entries[i];
+        PyFuncGuardObject *item = (PyFuncGuardObject *)entry->guard;
+
+        entry->nb_check++;
+        res = item->check((PyObject *)item, stack, nargs, kwnames);
+        if (unlikely(res)) {
+            if (res > 0)
+                entry->nb_fail++;
+            break;
+        }
+    }
+
+    guard->nesting--;
+    if (guard->reorder_pending && guard->nesting == 0)
+        guard_chain_reorder(guard);
+    Py_DECREF(guard);
+    return res;
+}
+
+static int
+guard_chain_check(PyObject *self, PyObject **stack, Py_ssize_t nargs, PyObject *kwnames)
+{
+    GuardChainObject *guard = (GuardChainObject *)self;
+
+    return guard_count_check(&guard->base,
+                             check_chain_guard(guard, stack, nargs, kwnames));
+}
+
+static void
+guard_chain_clear(GuardChainObject *self)
+{
+    Py_ssize_t i;
+
+    for (i=0; i < self->nguard; i++)
+        Py_CLEAR(self->entries[i].guard);
+    self->nguard = 0;
+    PyMem_Free(self->entries);
+    self->entries = NULL;
+}
+
+static void
+guard_chain_dealloc(GuardChainObject *self)
+{
+    guard_chain_clear(self);
+
+    PyFuncGuard_Type.tp_dealloc((PyObject *)self);
+}
+
+static int
+guard_chain_traverse(GuardChainObject *self, visitproc visit, void *arg)
+{
+    Py_ssize_t i;
+
+    for (i=0; i < self->nguard; i++)
+        Py_VISIT(self->entries[i].guard);
+    return 0;
+}
+
+static PyObject *
+guard_chain_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PyObject *op;
+    GuardChainObject *self;
+
+    op = PyFuncGuard_Type.tp_new(type, args, kwds);
+    if (op == NULL)
+        return NULL;
+
+    self = (GuardChainObject *)op;
+    self->base.base.init = guard_chain_init_guard;
+    self->base.base.check = guard_chain_check;
+    self->nguard = 0;
+    self->entries = NULL;
+    self->reorder_period = GUARD_CHAIN_REORDER_PERIOD;
+    self->reorder_countdown = GUARD_CHAIN_REORDER_PERIOD;
+    self->nesting = 0;
+    self->reorder_pending = 0;
+
+    return op;
+}
+
+static int
+guard_chain_init(PyObject *op, PyObject *args, PyObject *kwargs)
+{
+    GuardChainObject *self = (GuardChainObject *)op;
+    static char *keywords[] = {"guards", "reorder_period", NULL};
+    PyObject *guards, *seq;
+    Py_ssize_t reorder_period = GUARD_CHAIN_REORDER_PERIOD;
+    Py_ssize_t nguard, i;
+    GuardChainEntry *entries;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|n:GuardChain",
+                                     keywords, &guards, &reorder_period))
+        return -1;
+
+    if (reorder_period < 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "reorder_period must be positive or zero");
+        return -1;
+    }
+
+    seq = PySequence_Fast(guards, "guards must be a sequence");
+    if (seq == NULL)
+        return -1;
+
+    nguard = PySequence_Fast_GET_SIZE(seq);
+    if (nguard == 0) {
+        Py_DECREF(seq);
+        PyErr_SetString(PyExc_ValueError, "guards must not be empty");
+        return -1;
+    }
+
+    for (i=0; i < nguard; i++) {
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+
+        if (!PyObject_TypeCheck(item, &PyFuncGuard_Type)) {
+            PyErr_Format(PyExc_TypeError,
+                         "guards must only contain guards, got %s",
+                         Py_TYPE(item)->tp_name);
+            Py_DECREF(seq);
+            return -1;
+        }
+    }
+
+    entries = PyMem_Malloc(sizeof(GuardChainEntry) * nguard);
+    if (entries == NULL) {
+        Py_DECREF(seq);
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    for (i=0; i < nguard; i++) {
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+
+        Py_INCREF(item);
+        entries[i].guard = item;
+        entries[i].cost = guard_chain_cost(item);
+        entries[i].nb_check = 0;
+        entries[i].nb_fail = 0;
+    }
+    Py_DECREF(seq);
+
+    if (self->nesting > 0) {
+        /* a guard of the chain called __init__() during a check */
+        for (i=0; i < nguard; i++)
+            Py_DECREF(entries[i].guard);
+        PyMem_Free(entries);
+        PyErr_SetString(PyExc_RuntimeError,
+                        "cannot reinitialize a GuardChain during a check");
+        return -1;
+    }
+
+    guard_chain_clear(self);
+    self->nguard = nguard;
+    self->entries = entries;
+    self->reorder_period = reorder_period;
+
+    /* initial order: static cost classes */
+    guard_chain_reorder(self);
+    return 0;
+}
+
+static PyObject*
+guard_chain_get_guards(GuardChainObject *self)
+{
+    PyObject *list;
+    Py_ssize_t i;
+
+    list = PyList_New(self->nguard);
+    if (list == NULL)
+        return NULL;
+
+    for (i=0; i < self->nguard; i++) {
+        PyObject *guard = self->entries[i].guard;
+
+        Py_INCREF(guard);
+        PyList_SET_ITEM(list, i, guard);
+    }
+    return list;
+}
+
+static PyGetSetDef guard_chain_getsetlist[] = {
+    {"guards", (getter)guard_chain_get_guards, NULL, NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyMemberDef guard_chain_members[] = {
+    {"reorder_period",   T_PYSSIZET,   offsetof(GuardChainObject, reorder_period),
+     RESTRICTED|READONLY},
+    GUARD_MEMBERS
+    {NULL}  /* Sentinel */
+};
+
+PyDoc_STRVAR(guard_chain_doc,
+"GuardChain(guards, reorder_period=1000)\n"
+"\n"
+"Composite guard: pass if all guards pass, or return the result of the\n"
+"first guard which fails.\n"
+"\n"
+"Guards are first ordered by the static cost of their check. Every\n"
+"reorder_period checks, guards are reordered by cost divided by their\n"
+"observed failure rate, so the cheapest and likeliest-to-fail guards are\n"
+"checked first. A reorder_period of 0 keeps the static order. The guards\n"
+"attribute is the list of guards in the current order of the checks.");
+
+static PyTypeObject GuardChain_Type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    "fat.GuardChain",
+    sizeof(GuardChainObject),
+    0,
+    (destructor)guard_chain_dealloc,            /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_reserved */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
+    guard_chain_doc,                            /* tp_doc */
+    (traverseproc)guard_chain_traverse,         /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    0,                                          /* tp_methods */
+    guard_chain_members,                        /* tp_members */
+    guard_chain_getsetlist,                     /* tp_getset */
+    &PyFuncGuard_Type,                          /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    guard_chain_init,                           /* tp_init */
+    0,                                          /* tp_alloc */
+    guard_chain_new,                            /* tp_new */
+    0,                                          /* tp_free */
+};
+
+
+/* Functions */
+
+static PyObject*
+fat_guard_type_dict(PyObject *self, PyObject *args)
+{
+    PyObject *type, *type_dict, *keys;
+
+    if (!PyArg_ParseTuple(args, "O!O:guard_type_dict", &PyType_Type, &type, &keys))
+        return NULL;
+
+    type_dict = ((PyTypeObject*)type)->tp_dict;
+    assert(type_dict != NULL);
+
+    return PyObject_CallFunction((PyObject *)&GuardDict_Type, "OO", type_dict, keys);
+}
+
+PyDoc_STRVAR(guard_type_dict_doc,
+"guard_type_dict(attrs) -> GuardDict\n"
+"\n"
+"Guard on type.attr (type.__dict__[attr]) for all attrs.");
+
+
+static PyObject*
+replace_consts(PyObject *consts, PyObject *mapping)
+{
+    PyObject *new_consts, *value, *new_value;
+    Py_ssize_t i, size;
+
+    assert(PyTuple_CheckExact(consts));
+    assert(PyDict_Check(mapping));
+    size = PyTuple_GET_SIZE(consts);
+
+    new_consts = PyTuple_New(size);
+    for (i=0; i<size; i++) {
+        value = PyTuple_GET_ITEM(consts, i);
+
+        new_value = PyDict_GetItem(mapping, value);
+        if (new_value == NULL && PyErr_Occurred()) {
+            /* truncate the tuple to not read unitilized memory in
+               the tuple destructor */
+            Py_SIZE(new_consts) = i;
+            Py_DECREF(new_consts);
+            return NULL;
+        }
+
+        if (new_value != NULL)
+            value = new_value;
+
+        Py_INCREF(value);
+        PyTuple_SET_ITEM(new_consts, i, value);
+    }
+
+    return new_consts;
+}
+
+static PyObject *
+code_with_consts(PyCodeObject *code, PyObject *new_consts)
+{
+    return (PyObject *)PyCode_New(
+        code->co_argcount,
+        code->co_kwonlyargcount,
+        code->co_nlocals,
+        code->co_stacksize,
+        code->co_flags,
+        code->co_code,
+        new_consts,                /* replace constants */
+        code->co_names,
+        code->co_varnames,
+        code->co_freevars,
+        code->co_cellvars,
+        code->co_filename,
+        code->co_name,
+        code->co_firstlineno,
+        code->co_lnotab);
+}
+
+static PyObject* replace_const_recursive(PyObject *obj, PyObject *keys);
+
+/* Replace items of a tuple. Return a new reference to the tuple if no item
+   was replaced. */
+static PyObject*
+replace_tuple_items(PyObject *tuple, PyObject *keys)
+{
+    PyObject *new_tuple = NULL;
+    Py_ssize_t i, size;
+
+    size = PyTuple_GET_SIZE(tuple);
+    for (i=0; i < size; i++) {
+        PyObject *item = PyTuple_GET_ITEM(tuple, i);
+        PyObject *new_item;
+
+        new_item = replace_const_recursive(item, keys);
+        if (new_item == NULL)
+            goto error;
+
+        if (new_item == item && new_tuple == NULL) {
+            Py_DECREF(new_item);
+            continue;
+        }
+
+        if (new_tuple == NULL) {
+            Py_ssize_t j;
+
+            /* first replaced item: copy previous items */
+            new_tuple = PyTuple_New(size);
+            if (new_tuple == NULL) {
+                Py_DECREF(new_item);
+                goto error;
+            }
+            for (j=0; j < i; j++) {
+                PyObject *prev = PyTuple_GET_ITEM(tuple, j);
+                Py_INCREF(prev);
+                PyTuple_SET_ITEM(new_tuple, j, prev);
+            }
+        }
+        PyTuple_SET_ITEM(new_tuple, i, new_item);
+    }
+
+    if (new_tuple == NULL) {
+        Py_INCREF(tuple);
+        return tuple;
+    }
+    return new_tuple;
+
+error:
+    if (new_tuple != NULL) {
+        /* truncate the tuple to not read unitilized memory in
+           the tuple destructor */
+        Py_SIZE(new_tuple) = i;
+        Py_DECREF(new_tuple);
+    }
+    return NULL;
+}
+
+static PyObject*
+replace_frozenset_items(PyObject *set, PyObject *keys)
+{
+    PyObject *items, *new_items, *new_set;
+
+    items = PySequence_Tuple(set);
+    if (items == NULL)
+        return NULL;
+
+    new_items = replace_tuple_items(items, keys);
+    if (new_items == NULL) {
+        Py_DECREF(items);
+        return NULL;
+    }
+
+    if (new_items == items) {
+        Py_DECREF(items);
+        Py_DECREF(new_items);
+        Py_INCREF(set);
+        return set;
+    }
+
+    Py_DECREF(items);
+    new_set = PyFrozenSet_New(new_items);
+    Py_DECREF(new_items);
+    return new_set;
+}
+
+static PyObject*
+replace_code_consts(PyCodeObject *code, PyObject *keys)
+{
+    PyObject *new_consts, *new_code;
+
+    new_consts = replace_tuple_items(code->co_consts, keys);
+    if (new_consts == NULL)
+        return NULL;
+
+    if (new_consts == code->co_consts) {
+        Py_DECREF(new_consts);
+        Py_INCREF(code);
+        return (PyObject *)code;
+    }
+
+    new_code = code_with_consts(code, new_consts);
+    Py_DECREF(new_consts);
+    return new_code;
+}
+
+/* Replace a constant, or its items. keys maps _PyCode_ConstantKey(old)
+   to the new value. Return a new reference to obj if it is unchanged. */
+static PyObject*
+replace_const_recursive(PyObject *obj, PyObject *keys)
+{
+    PyObject *key, *new_value;
+
+    key = _PyCode_ConstantKey(obj);
+    if (key == NULL)
+        return NULL;
+
+    new_value = PyDict_GetItemWithError(keys, key);
+    Py_DECREF(key);
+    if (new_value != NULL) {
+        Py_INCREF(new_value);
+        return new_value;
+    }
+    if (PyErr_Occurred())
+        return NULL;
+
+    if (PyTuple_CheckExact(obj))
+        return replace_tuple_items(obj, keys);
+    if (PyFrozenSet_CheckExact(obj))
+        return replace_frozenset_items(obj, keys);
+    if (PyCode_Check(obj))
+        return replace_code_consts((PyCodeObject *)obj, keys);
+
+    Py_INCREF(obj);
+    return obj;
+}
+
+static PyObject *
+fat_replace_consts(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"code", "mapping", "recursive", NULL};
+    PyCodeObject *code;
+    PyObject *mapping;
+    int recursive = 0;
+    PyObject *new_consts, *new_code;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O!O!|$p:replace_consts",
+                                     keywords,
+                                     &PyCode_Type, &code,
+                                     &PyDict_Type, &mapping,
+                                     &recursive))
+        return NULL;
+
+    if (recursive) {
+        PyObject *keys, *key, *value;
+        Py_ssize_t pos = 0;
+
+        /* match constants by type and value: 1, 1.0 and True are different */
+        keys = PyDict_New();
+        if (keys == NULL)
+            return NULL;
+
+        while (PyDict_Next(mapping, &pos, &key, &value)) {
+            PyObject *const_key = _PyCode_ConstantKey(key);
+            int res;
+
+            if (const_key == NULL) {
+                Py_DECREF(keys);
+                return NULL;
+            }
+            res = PyDict_SetItem(keys, const_key, value);
+            Py_DECREF(const_key);
+            if (res < 0) {
+                Py_DECREF(keys);
+                return NULL;
+            }
+        }
+
+        new_consts = replace_tuple_items(code->co_consts, keys);
+        Py_DECREF(keys);
+    }
+    else
+        new_consts = replace_consts(code->co_consts, mapping);
+    if (new_consts == NULL)
+        return NULL;
+
+    new_code = code_with_consts(code, new_consts);
+    Py_DECREF(new_consts);
+
+    return new_code;
+}
+
+PyDoc_STRVAR(patch_constants_doc,
+"replace_constants(code, mapping, *, recursive=False) -> code\n"
+"\n"
+"Create a new code object with new constants using the constant mapping:\n"
+"old constant value => new constant value.\n"
+"\n"
+"If recursive is true, constants are matched by type and value (1, 1.0\n"
+"and True are different), and constants of nested code objects, tuples\n"
+"and frozensets are also replaced. Only modified objects are rebuilt.");
+
+
+/* Get the mapping name => value of a dict or of the pairs of a GuardDict */
+static PyObject*
+inline_globals_mapping(PyObject *obj)
+{
+    GuardDictObject *guard;
+    GuardFrozenDictObject *frozen;
+    PyObject *mapping;
+    Py_ssize_t i;
+
+    if (PyDict_Check(obj)) {
+        Py_INCREF(obj);
+        return obj;
+    }
+
+    if (!PyObject_TypeCheck(obj, &GuardDict_Type)) {
+        PyErr_Format(PyExc_TypeError,
+                     "mapping must be a dict or a GuardDict, not %s",
+                     Py_TYPE(obj)->tp_name);
+        return NULL;
+    }
+
+    guard = (GuardDictObject *)obj;
+
+    if (Py_TYPE(obj) == &GuardFrozenDict_Type && guard->keys.npair == 0) {
+        /* a GuardFrozenDict without key captures the whole dict: the dict
+           is the snapshot until it is modified */
+        frozen = (GuardFrozenDictObject *)obj;
+        if (DICT_VERSION(guard->keys.dict) != frozen->dict_version) {
+            PyErr_SetString(PyExc_ValueError,
+                            "the dict of the GuardFrozenDict was modified");
+            return NULL;
+        }
+        return PyDict_Copy(guard->keys.dict);
+    }
+
+    mapping = PyDict_New();
+    if (mapping == NULL)
+        return NULL;
+
+    for (i=0; i < guard->keys.npair; i++) {
+        GuardDictPair *pair = &guard->keys.pairs[i];
+
+        /* missing key */
+        if (pair->value == NULL)
+            continue;
+
+        if (PyDict_SetItem(mapping, pair->key, pair->value) < 0) {
+            Py_DECREF(mapping);
+            return NULL;
+        }
+    }
+    return mapping;
+}
+
+/* Get the index of the constant of a name, add the constant if needed.
+   Return -1 if the name is not inlined, -2 on error. */
+static Py_ssize_t
+inline_globals_const(PyObject *name, PyObject *mapping, PyObject *consts)
+{
+    PyObject *value;
+    Py_ssize_t i, nconst;
+
+    value = PyDict_GetItemWithError(mapping, name);
+    if (value == NULL)
+        return PyErr_Occurred() ? -2 : -1;
+
+    /* values are compared by identity: the value captured by the guard
+       must be used, not an equal value */
+    nconst = PyList_GET_SIZE(consts);
+    for (i=0; i < nconst; i++) {
+        if (PyList_GET_ITEM(consts, i) == value)
+            return i;
+    }
+
+    if (PyList_Append(consts, value) < 0)
+        return -2;
+    return nconst;
+}
+
+static PyObject *
+fat_inline_globals(PyObject *self, PyObject *args)
+{
+    PyCodeObject *code;
+    PyObject *mapping_obj, *mapping = NULL;
+    PyObject *consts = NULL, *new_consts = NULL;
+    PyObject *co_code = NULL, *new_code = NULL;
+    unsigned char *bytecode;
+    Py_ssize_t *name_consts = NULL;
+    char *stored = NULL;
+    Py_ssize_t size, nname, i, arg;
+    int nprefix;
+
+    if (!PyArg_ParseTuple(args, "O!O:inline_globals",
+                          &PyCode_Type, &code, &mapping_obj))
+        return NULL;
+
+    mapping = inline_globals_mapping(mapping_obj);
+    if (mapping == NULL)
+        return NULL;
+
+    consts = PySequence_List(code->co_consts);
+    if (consts == NULL)
+        goto error;
+
+    size = PyBytes_GET_SIZE(code->co_code);
+    co_code = PyBytes_FromStringAndSize(PyBytes_AS_STRING(code->co_code),
+                                        size);
+    if (co_code == NULL)
+        goto error;
+    bytecode = (unsigned char *)PyBytes_AS_STRING(co_code);
+
+    nname = PyTuple_GET_SIZE(code->co_names);
+    name_consts = PyMem_Malloc(Py_MAX(nname, 1) * sizeof(name_consts[0]));
+    stored = PyMem_Malloc(Py_MAX(nname, 1));
+    if (name_consts == NULL || stored == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    for (i=0; i < nname; i++) {
+        /* constant index not computed yet */
+        name_consts[i] = -3;
+        stored[i] = 0;
+    }
+
+    /* LOAD_GLOBAL and LOAD_NAME are only replaced if the name is never
+       stored or deleted by the code, in the local or in the global
+       namespace */
+    arg = 0;
+    for (i=0; i + 1 < size; i += 2) {
+        int opcode = bytecode[i];
+
+        arg |= bytecode[i+1];
+        if (opcode == EXTENDED_ARG) {
+            arg <<= 8;
+            continue;
+        }
+        if ((opcode == STORE_NAME || opcode == DELETE_NAME
+             || opcode == STORE_GLOBAL || opcode == DELETE_GLOBAL)
+            && arg < nname)
+            stored[arg] = 1;
+        arg = 0;
+    }
+
+    arg = 0;
+    nprefix = 0;
+    for (i=0; i + 1 < size; i += 2) {
+        int opcode = bytecode[i];
+        Py_ssize_t const_index;
+        int k;
+
+        arg |= bytecode[i+1];
+        if (opcode == EXTENDED_ARG) {
+            arg <<= 8;
+            nprefix++;
+            continue;
+        }
+
+        if (arg < nname
+            && (opcode == LOAD_GLOBAL || opcode == LOAD_NAME)
+            && !stored[arg]) {
+            const_index = name_consts[arg];
+            if (const_index == -3) {
+                const_index = inline_globals_const(
+                                  PyTuple_GET_ITEM(code->co_names, arg),
+                                  mapping, consts);
+                if (const_index == -2)
+                    goto error;
+                name_consts[arg] = const_index;
+            }
+
+            /* the instruction cannot be longer: skip the instruction if
+               the constant index requires more EXTENDED_ARG prefixes */
+            if (const_index >= 0
+                && (nprefix >= 3
+                    || const_index < ((Py_ssize_t)1 << (8 * (nprefix + 1))))) {
+                for (k=0; k < nprefix; k++) {
+                    bytecode[i - 2 * (nprefix - k) + 1] =
+                        (unsigned char)(const_index >> (8 * (nprefix - k)));
+                }
+                bytecode[i] = LOAD_CONST;
+                bytecode[i+1] = (unsigned char)const_index;
+            }
+        }
+
+        arg = 0;
+        nprefix = 0;
+    }
+
+    new_consts = PyList_AsTuple(consts);
+    if (new_consts == NULL)
+        goto error;
+
+    /* LOAD_CONST has the same stack effect than LOAD_GLOBAL and LOAD_NAME:
+       the stack size is unchanged. Unused names are kept in co_names. */
+    new_code = (PyObject *)PyCode_New(
+        code->co_argcount,
+        code->co_kwonlyargcount,
+        code->co_nlocals,
+        code->co_stacksize,
+        code->co_flags,
+        co_code,                   /* replace bytecode */
+        new_consts,                /* replace constants */
+        code->co_names,
+        code->co_varnames,
+        code->co_freevars,
+        code->co_cellvars,
+        code->co_filename,
+        code->co_name,
+        code->co_firstlineno,
+        code->co_lnotab);
+
+error:
+    PyMem_Free(name_consts);
+    PyMem_Free(stored);
+    Py_XDECREF(co_code);
+    Py_XDECREF(new_consts);
+    Py_XDECREF(consts);
+    Py_XDECREF(mapping);
+    return new_code;
+}
+
+PyDoc_STRVAR(inline_globals_doc,
+"inline_globals(code, mapping) -> code\n"
+"\n"
+"Create a new code object where LOAD_GLOBAL and LOAD_NAME instructions\n"
+"loading a name of mapping are replaced with LOAD_CONST of its value.\n"
+"\n"
+"mapping is a dict name => value, or a GuardDict, GuardGlobals or\n"
+"GuardBuiltins: in this case, the values captured by the guard are used.\n"
+"For a GuardFrozenDict without key, all values of the dict are used;\n"
+"ValueError is raised if the dict was modified since the guard creation.\n"
+"A name is not replaced if the code stores or deletes it.");
+
+
+static PyObject *
+fat_specialize(PyObject *self, PyObject *args)
+{
+    PyObject *func, *code, *guards;
+    int res;
+
+    if (!PyArg_ParseTuple(args, "O!OO:specialize",
+                          &PyFunction_Type, &func, &code, &guards))
+        return NULL;
+
+    res = PyFunction_Specialize(func, code, guards);
+    if (res < 0)
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(specialize_doc,
+"specialize(func, code, guards) -> bool\n"
+"\n"
+"Specialize a function: add a specialized code with guards.");
+
+
+static PyObject *
+fat_get_specialized(PyObject *self, PyObject *args)
+{
+    PyObject *func;
+
+    if (!PyArg_ParseTuple(args, "O!:get_specialized",
+                          &PyFunction_Type, &func))
+        return NULL;
+
+    return PyFunction_GetSpecializedCodes(func);
+}
+
+PyDoc_STRVAR(get_specialized_doc,
+"get_specialized(func) -> list\n"
+"\n"
+"Get the list of specialized codes as a list of (code, guards)\n"
+"tuples where code is a callable or code object and guards is a list\n"
+"of guards.");
+
+static int
+Guard_Check(PyObject *op)
+{
+    return (PyObject_TypeCheck(op, &GuardArgType_Type)
+            || PyObject_TypeCheck(op, &GuardSignature_Type)
+            || PyObject_TypeCheck(op, &GuardTypeDispatch_Type)
+            || PyObject_TypeCheck(op, &GuardArgValue_Type)
+            || PyObject_TypeCheck(op, &GuardArgRange_Type)
+            || PyObject_TypeCheck(op, &GuardArgShape_Type)
+            || PyObject_TypeCheck(op, &GuardFunc_Type)
+            || PyObject_TypeCheck(op, &GuardTypeVersion_Type)
+            || PyObject_TypeCheck(op, &GuardInstanceLayout_Type)
+            || PyObject_TypeCheck(op, &GuardChain_Type)
+            || PyObject_TypeCheck(op, &GuardModuleAttr_Type)
+            || PyObject_TypeCheck(op, &GuardDict_Type));
+}
+
+static void
+guard_add_stats(GuardObject *guard, GuardObject *stats)
+{
+    stats->nb_check += guard->nb_check;
+#if FAT_STATS
+    stats->nb_fail += guard->nb_fail;
+    stats->nb_slow += guard->nb_slow;
+#endif
+}
+
+static void
+guard_reset_stats(GuardObject *guard, GuardObject *unused)
+{
+    guard->nb_check = 0;
+    /* forget failures before the reset */
+    guard->fail_score = 0;
+    guard->decay_check = 0;
+#if FAT_STATS
+    guard->nb_fail = 0;
+    guard->nb_slow = 0;
+#endif
+}
+
+static void
+guard_copy_stats(GuardObject *dst, GuardObject *src)
+{
+    dst->nb_check = src->nb_check;
+    dst->fail_score = src->fail_score;
+    dst->decay_check = src->decay_check;
+#if FAT_STATS
+    dst->nb_fail = src->nb_fail;
+    dst->nb_slow = src->nb_slow;
+#endif
+}
+
+/* Call callback(guard, arg) on all guards of the specialized codes of a
+   function */
+static int
+func_guards_foreach(PyObject *func, void (*callback) (GuardObject *, GuardObject *),
+                    GuardObject *arg)
+{
+    PyObject *specialized;
+    Py_ssize_t i, j;
+
+    specialized = PyFunction_GetSpecializedCodes(func);
+    if (specialized == NULL)
+        return -1;
+
+    for (i=0; i < PyList_GET_SIZE(specialized); i++) {
+        PyObject *item = PyList_GET_ITEM(specialized, i);
+        PyObject *guards;
+
+        assert(PyTuple_Check(item) && PyTuple_GET_SIZE(item) == 2);
+        guards = PyTuple_GET_ITEM(item, 1);
+        assert(PyList_Check(guards));
+
+        for (j=0; j < PyList_GET_SIZE(guards); j++) {
+            PyObject *guard = PyList_GET_ITEM(guards, j);
+
+            if (Guard_Check(guard))
+                callback((GuardObject *)guard, arg);
+        }
+    }
+
+    Py_DECREF(specialized);
+    return 0;
+}
+
+static PyObject *
+fat_get_stats(PyObject *self, PyObject *args)
+{
+    PyObject *obj;
+    GuardObject stats;
+
+    if (!PyArg_ParseTuple(args, "O:get_stats", &obj))
+        return NULL;
+
+    memset(&stats, 0, sizeof(stats));
+    if (PyFunction_Check(obj)) {
+        if (func_guards_foreach(obj, guard_add_stats, &stats) < 0)
+            return NULL;
+    }
+    else if (Guard_Check(obj)) {
+        guard_add_stats((GuardObject *)obj, &stats);
+    }
+    else {
+        PyErr_Format(PyExc_TypeError,
+                     "expect a function or a guard, got %s",
+                     Py_TYPE(obj)->tp_name);
+        return NULL;
+    }
+
+#if FAT_STATS
+    return Py_BuildValue("{snsnsnsn}",
+                         "checks", stats.nb_check,
+                         "fails", stats.nb_fail,
+                         "fast", stats.nb_check - stats.nb_slow,
+                         "slow", stats.nb_slow);
+#else
+    return Py_BuildValue("{sn}",
+                         "checks", stats.nb_check);
+#endif
+}
+
+PyDoc_STRVAR(get_stats_doc,
+"get_stats(obj) -> dict\n"
+"\n"
+"Get statistics on checks of a guard, or of all guards of a function.\n"
+"\n"
+"The dict has the following keys: 'checks' (number of checks), 'fails'\n"
+"(number of failed checks), 'fast' (number of checks which didn't have to\n"
+"revalidate the guard) and 'slow' (number of checks which revalidated the\n"
+"guard because a watched object was modified). Only 'checks' is\n"
+"available if the fat module was compiled with FAT_STATS=0: the number of\n"
+"checks is also used by the deoptimization policy.");
+
+
+static PyObject *
+fat_reset_stats(PyObject *self, PyObject *args)
+{
+    PyObject *obj;
+
+    if (!PyArg_ParseTuple(args, "O:reset_stats", &obj))
+        return NULL;
+
+    if (PyFunction_Check(obj)) {
+        if (func_guards_foreach(obj, guard_reset_stats, NULL) < 0)
+            return NULL;
+    }
+    else if (Guard_Check(obj)) {
+        guard_reset_stats((GuardObject *)obj, NULL);
+    }
+    else {
+        PyErr_Format(PyExc_TypeError,
+                     "expect a function or a guard, got %s",
+                     Py_TYPE(obj)->tp_name);
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(reset_stats_doc,
+"reset_stats(obj)\n"
+"\n"
+"Reset statistics of a guard, or of all guards of a function.\n"
+"\n"
+"Failures before the reset are no longer counted by the deoptimization\n"
+"policy.");
+
+
+static PyObject *
+fat_set_deopt_policy(PyObject *self, PyObject *args)
+{
+    Py_ssize_t threshold, window;
+
+    if (!PyArg_ParseTuple(args, "nn:set_deopt_policy", &threshold, &window))
+        return NULL;
+
+    if (threshold < 0) {
+        PyErr_SetString(PyExc_ValueError, "threshold must be positive or zero");
+        return NULL;
+    }
+    if (window < 1) {
+        PyErr_SetString(PyExc_ValueError, "window must be at least 1");
+        return NULL;
+    }
+
+    deopt_threshold = threshold;
+    deopt_window = window;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(set_deopt_policy_doc,
+"set_deopt_policy(threshold, window)\n"
+"\n"
+"Disable a guard when its number of failures reaches threshold, the number\n"
+"of failures is halved every window checks. A disabled guard always fails,\n"
+"so its specialized code is removed. A threshold of 0 never disables\n"
+"guards.");
+
+
+static PyObject *
+fat_get_deopt_policy(PyObject *self, PyObject *args)
+{
+    return Py_BuildValue("nn", deopt_threshold, deopt_window);
+}
+
+PyDoc_STRVAR(get_deopt_policy_doc,
+"get_deopt_policy() -> (threshold, window)\n"
+"\n"
+"Get the deoptimization policy of guards.");
+
+static PyObject *
+fat_bench_check(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"guard", "args", "kwargs", "loops", "modify",
+                               NULL};
+    PyObject *guard, *args_obj = NULL, *kwargs_obj = NULL, *modify = NULL;
+    PyObject *modify_obj = NULL, *modify_key = NULL;
+    PyObject *values[2] = {NULL, NULL};
+    PyObject *kwnames = NULL;
+    PyObject **stack = NULL;
+    Py_ssize_t loops = 1000000, nargs = 0, nkwargs = 0, i;
+    PyFuncGuardObject *func_guard = NULL;
+    GuardObject *fat_guard = NULL;
+    GuardObject saved_stats;
+    Py_ssize_t saved_threshold;
+    _PyTime_t start, dt;
+    int res = 0;
+    PyObject *result = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O!OnO:_bench_check",
+                                     keywords, &guard,
+                                     &PyTuple_Type, &args_obj,
+                                     &kwargs_obj,
+                                     &loops, &modify))
+        return NULL;
+
+    if (kwargs_obj == Py_None)
+        kwargs_obj = NULL;
+    if (kwargs_obj != NULL && !PyDict_Check(kwargs_obj)) {
+        PyErr_Format(PyExc_TypeError,
+                     "kwargs must be a dict or None, not %s",
+                     Py_TYPE(kwargs_obj)->tp_name);
+        return NULL;
+    }
+
+    if (guard != Py_None) {
+        if (!PyObject_TypeCheck(guard, &PyFuncGuard_Type)) {
+            PyErr_Format(PyExc_TypeError,
+                         "guard must be a guard or None, not %s",
+                         Py_TYPE(guard)->tp_name);
+            return NULL;
+        }
+        func_guard = (PyFuncGuardObject *)guard;
+    }
+    if (loops < 1) {
+        PyErr_SetString(PyExc_ValueError, "loops must be at least 1");
+        return NULL;
+    }
+    if (modify != NULL && modify != Py_None) {
+        if (!PyArg_ParseTuple(modify, "OO:_bench_check", &modify_obj, &modify_key))
+            return NULL;
+    }
+
+    if (args_obj != NULL)
+        nargs = PyTuple_GET_SIZE(args_obj);
+    if (kwargs_obj != NULL)
+        nkwargs = PyDict_Size(kwargs_obj);
+
+    stack = PyMem_Malloc(Py_MAX(nargs + nkwargs, 1) * sizeof(stack[0]));
+    if (stack == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    for (i=0; i < nargs; i++)
+        stack[i] = PyTuple_GET_ITEM(args_obj, i);
+    if (nkwargs) {
+        PyObject *key, *value;
+        Py_ssize_t pos = 0, k = 0;
+
+        kwnames = PyTuple_New(nkwargs);
+        if (kwnames == NULL)
+            goto error;
+        while (PyDict_Next(kwargs_obj, &pos, &key, &value)) {
+            Py_INCREF(key);
+            PyTuple_SET_ITEM(kwnames, k, key);
+            stack[nargs + k] = value;
+            k++;
+        }
+    }
+
+    /* modify stores alternatively two different values */
+    if (modify_obj != NULL) {
+        values[0] = PyLong_FromLong(1000);
+        values[1] = PyLong_FromLong(1001);
+        if (values[0] == NULL || values[1] == NULL)
+            goto error;
+    }
+
+    /* the benchmark must not change the statistics of the guard nor
+       disable it (or a guard nested in it): restore the counters of the
+       guard at exit, and don't apply the deoptimization policy */
+    if (guard != Py_None && Guard_Check(guard)) {
+        fat_guard = (GuardObject *)guard;
+        guard_copy_stats(&saved_stats, fat_guard);
+    }
+    saved_threshold = deopt_threshold;
+    deopt_threshold = 0;
+
+    start = _PyTime_GetMonotonicClock();
+    for (i=0; i < loops; i++) {
+        if (modify_obj != NULL) {
+            PyObject *value = values[i & 1];
+
+            if (PyDict_Check(modify_obj))
+                res = PyDict_SetItem(modify_obj, modify_key, value);
+            else
+                res = PyObject_SetAttr(modify_obj, modify_key, value);
+            if (res < 0)
+                goto restore;
+        }
+
+        if (func_guard != NULL) {
+            res = func_guard->check(guard, stack, nargs, kwnames);
+            if (res < 0)
+                goto restore;
+        }
+    }
+    dt = _PyTime_GetMonotonicClock() - start;
+
+    result = Py_BuildValue("di", _PyTime_AsSecondsDouble(dt), res);
 
+restore:
+    deopt_threshold = saved_threshold;
+    if (fat_guard != NULL)
+        guard_copy_stats(fat_guard, &saved_stats);
 
-/* Functions */
+error:
+    Py_XDECREF(values[0]);
+    Py_XDECREF(values[1]);
+    Py_XDECREF(kwnames);
+    PyMem_Free(stack);
+    return result;
+}
 
-static PyObject*
-fat_guard_type_dict(PyObject *self, PyObject *args)
+PyDoc_STRVAR(bench_check_doc,
+"_bench_check(guard, args=(), kwargs=None, loops=1000000, modify=None)\n"
+"    -> (seconds, result)\n"
+"\n"
+"Call the check function of a guard loops times in a C loop with the\n"
+"arguments args and kwargs. Return the elapsed time measured by a\n"
+"monotonic clock, and the result of the last check.\n"
+"\n"
+"If modify is an (obj, name) tuple, obj[name] (obj.name if obj is not a\n"
+"dict) is set to a different value before each check, to measure the slow\n"
+"path of guards. guard can be None to only measure the modification.\n"
+"\n"
+"The statistics of the guard are restored and guards are not disabled by\n"
+"the deoptimization policy during the benchmark.\n"
+"\n"
+"Internal function used by benchmarks.");
+
+
+static PyObject *
+fat_attr_index(PyObject *self, PyObject *args)
 {
-    PyObject *type, *type_dict, *keys;
+    PyObject *obj, *name, *value;
+    PyDictObject *dict;
+    Py_ssize_t ix;
 
-    if (!PyArg_ParseTuple(args, "O!O:guard_type_dict", &PyType_Type, &type, &keys))
+    if (!PyArg_ParseTuple(args, "OU:attr_index", &obj, &name))
         return NULL;
 
-    type_dict = ((PyTypeObject*)type)->tp_dict;
-    assert(type_dict != NULL);
+    dict = get_split_instance_dict(obj);
+    if (dict == NULL) {
+        PyErr_Format(PyExc_ValueError,
+                     "%s instance has no split-keys dictionary",
+                     Py_TYPE(obj)->tp_name);
+        return NULL;
+    }
 
-    return PyObject_CallFunction((PyObject *)&GuardDict_Type, "OO", type_dict, keys);
+    ix = dict_lookup_index(dict, name, &value);
+    if (ix == DKIX_ERROR)
+        return NULL;
+    if (ix < 0)
+        ix = -1;
+    return PyLong_FromSsize_t(ix);
 }
 
-PyDoc_STRVAR(guard_type_dict_doc,
-"guard_type_dict(attrs) -> GuardDict\n"
+PyDoc_STRVAR(attr_index_doc,
+"attr_index(obj, name) -> int\n"
 "\n"
-"Guard on type.attr (type.__dict__[attr]) for all attrs.");
+"Get the index of an attribute in the shared keys of the instance\n"
+"dictionary of obj, or -1 if the keys don't contain the attribute.\n"
+"\n"
+"The index is the same for all instances checked by a GuardInstanceLayout\n"
+"created with obj. The attribute may be unset on an instance.");
 
 
-static PyObject*
-replace_consts(PyObject *consts, PyObject *mapping)
+/* Cache of shared dict guards: (type, id(globals), id(builtins), id(dict),
+   keys) => guard. Guards keep their dict alive, so ids are not reused while
+   the guard is cached. */
+static PyObject *guard_cache = NULL;
+static Py_ssize_t guard_cache_hits = 0;
+static Py_ssize_t guard_cache_misses = 0;
+
+/* maximum number of cached guards */
+#define GUARD_CACHE_SIZE 1024
+
+/* Check if a cached guard still passes: a guard which failed must not be
+   reused by a new specialization */
+static int
+guard_cache_valid(PyObject *op)
 {
-    PyObject *new_consts, *value, *new_value;
-    Py_ssize_t i, size;
+    PyTypeObject *type = Py_TYPE(op);
+    int res;
 
-    assert(PyTuple_CheckExact(consts));
-    assert(PyDict_Check(mapping));
-    size = PyTuple_GET_SIZE(consts);
+    if (((GuardObject *)op)->disabled)
+        return 0;
 
-    new_consts = PyTuple_New(size);
-    for (i=0; i<size; i++) {
-        value = PyTuple_GET_ITEM(consts, i);
+    if (type == &GuardBuiltins_Type)
+        res = check_builtins_guard((GuardBuiltinsObject *)op);
+    else if (type == &GuardGlobals_Type)
+        res = check_globals_guard((GuardDictObject *)op);
+    else
+        res = check_dict_guard((GuardDictObject *)op);
+    if (res < 0)
+        return -1;
+    return (res == 0);
+}
 
-        new_value = PyDict_GetItem(mapping, value);
-        if (new_value == NULL && PyErr_Occurred()) {
-            /* truncate the tuple to not read unitilized memory in
-               the tuple destructor */
-            Py_SIZE(new_consts) = i;
-            Py_DECREF(new_consts);
-            return NULL;
+/* Make room in the full guard cache: remove guards which are only
+   referenced by the cache and disabled guards. If all guards are used,
+   remove the oldest guard. */
+static int
+guard_cache_purge(void)
+{
+    PyObject *keys, *key, *guard;
+    Py_ssize_t pos = 0, i;
+
+    keys = PyList_New(0);
+    if (keys == NULL)
+        return -1;
+
+    while (PyDict_Next(guard_cache, &pos, &key, &guard)) {
+        if (Py_REFCNT(guard) == 1 || ((GuardObject *)guard)->disabled) {
+            if (PyList_Append(keys, key) < 0)
+                goto error;
         }
+    }
 
-        if (new_value != NULL)
-            value = new_value;
+    if (PyList_GET_SIZE(keys) == 0) {
+        pos = 0;
+        if (PyDict_Next(guard_cache, &pos, &key, &guard)) {
+            /* dict iteration order is the insertion order */
+            if (PyList_Append(keys, key) < 0)
+                goto error;
+        }
+    }
 
-        Py_INCREF(value);
-        PyTuple_SET_ITEM(new_consts, i, value);
+    /* destroying a guard can execute arbitrary code which modifies the
+       cache: ignore missing keys */
+    for (i=0; i < PyList_GET_SIZE(keys); i++) {
+        if (PyDict_DelItem(guard_cache, PyList_GET_ITEM(keys, i)) < 0) {
+            if (!PyErr_ExceptionMatches(PyExc_KeyError))
+                goto error;
+            PyErr_Clear();
+        }
     }
+    Py_DECREF(keys);
+    return 0;
 
-    return new_consts;
+error:
+    Py_DECREF(keys);
+    return -1;
 }
 
 static PyObject *
-fat_replace_consts(PyObject *self, PyObject *args)
+guard_cache_key(PyTypeObject *type, PyObject *guard_args)
 {
-    PyCodeObject *code;
-    PyObject *mapping;
-    PyObject *new_consts, *new_code;
-
-    if (!PyArg_ParseTuple(args, "O!O!:replace_consts",
-                          &PyCode_Type, &code,
-                          &PyDict_Type, &mapping))
-        return NULL;
+    PyObject *globals = Py_None, *builtins = Py_None, *dict = Py_None;
+    PyObject *keys, *key = NULL;
+    Py_ssize_t first_key = 0, i;
+
+    if (type == &GuardDict_Type) {
+        if (PyTuple_GET_SIZE(guard_args) == 0)
+            Py_RETURN_NONE;
+        dict = guard_dict_unwrap(PyTuple_GET_ITEM(guard_args, 0));
+        if (dict == NULL)
+            Py_RETURN_NONE;
+        first_key = 1;
+    }
+    else {
+        globals = PyEval_GetGlobals();
+        if (globals == NULL)
+            Py_RETURN_NONE;
+        if (type == &GuardBuiltins_Type) {
+            builtins = PyEval_GetBuiltins();
+            if (builtins == NULL)
+                Py_RETURN_NONE;
+        }
+    }
 
-    new_consts = replace_consts(code->co_consts, mapping);
-    if (new_consts == NULL)
+    keys = PyTuple_GetSlice(guard_args, first_key, PyTuple_GET_SIZE(guard_args));
+    if (keys == NULL)
         return NULL;
+    for (i=0; i < PyTuple_GET_SIZE(keys); i++) {
+        if (!PyUnicode_CheckExact(PyTuple_GET_ITEM(keys, i))) {
+            /* let the guard constructor report the error */
+            Py_DECREF(keys);
+            Py_RETURN_NONE;
+        }
+    }
 
-    new_code = (PyObject *)PyCode_New(
-        code->co_argcount,
-        code->co_kwonlyargcount,
-        code->co_nlocals,
-        code->co_stacksize,
-        code->co_flags,
-        code->co_code,
-        new_consts,                /* replace constants */
-        code->co_names,
-        code->co_varnames,
-        code->co_freevars,
-        code->co_cellvars,
-        code->co_filename,
-        code->co_name,
-        code->co_firstlineno,
-        code->co_lnotab);
-    Py_DECREF(new_consts);
-
-    return new_code;
+    globals = (globals != Py_None) ? PyLong_FromVoidPtr(globals) : NULL;
+    builtins = (builtins != Py_None) ? PyLong_FromVoidPtr(builtins) : NULL;
+    dict = (dict != Py_None) ? PyLong_FromVoidPtr(dict) : NULL;
+    if (!PyErr_Occurred()) {
+        key = Py_BuildValue("(OOOOO)", type,
+                            globals ? globals : Py_None,
+                            builtins ? builtins : Py_None,
+                            dict ? dict : Py_None,
+                            keys);
+    }
+    Py_XDECREF(globals);
+    Py_XDECREF(builtins);
+    Py_XDECREF(dict);
+    Py_DECREF(keys);
+    return key;
 }
 
-PyDoc_STRVAR(patch_constants_doc,
-"replace_constants(code, mapping) -> code\n"
-"\n"
-"Create a new code object with new constants using the constant mapping:\n"
-"old constant value => new constant value.");
-
-
 static PyObject *
-fat_specialize(PyObject *self, PyObject *args)
+fat_shared_guard(PyObject *self, PyObject *args)
 {
-    PyObject *func, *code, *guards;
-    int res;
+    PyObject *type, *guard_args, *key, *guard;
+    int valid;
 
-    if (!PyArg_ParseTuple(args, "O!OO:specialize",
-                          &PyFunction_Type, &func, &code, &guards))
+    if (PyTuple_GET_SIZE(args) < 1) {
+        PyErr_SetString(PyExc_TypeError, "missing guard type");
+        return NULL;
+    }
+    type = PyTuple_GET_ITEM(args, 0);
+    if (type != (PyObject *)&GuardDict_Type
+        && type != (PyObject *)&GuardGlobals_Type
+        && type != (PyObject *)&GuardBuiltins_Type) {
+        PyErr_Format(PyExc_TypeError,
+                     "guard type must be GuardDict, GuardGlobals or "
+                     "GuardBuiltins, not %R", type);
         return NULL;
+    }
 
-    res = PyFunction_Specialize(func, code, guards);
-    if (res < 0)
+    guard_args = PyTuple_GetSlice(args, 1, PyTuple_GET_SIZE(args));
+    if (guard_args == NULL)
         return NULL;
 
-    Py_RETURN_NONE;
+    key = guard_cache_key((PyTypeObject *)type, guard_args);
+    if (key == NULL)
+        goto error;
+    if (key == Py_None) {
+        /* invalid arguments: don't cache the guard */
+        Py_DECREF(key);
+        guard = PyObject_Call(type, guard_args, NULL);
+        Py_DECREF(guard_args);
+        return guard;
+    }
+
+    guard = PyDict_GetItem(guard_cache, key);
+    if (guard != NULL) {
+        Py_INCREF(guard);
+        valid = guard_cache_valid(guard);
+        if (valid < 0) {
+            Py_DECREF(guard);
+            goto error;
+        }
+        if (valid) {
+            guard_cache_hits++;
+            Py_DECREF(key);
+            Py_DECREF(guard_args);
+            return guard;
+        }
+        Py_DECREF(guard);
+
+        /* the guard failed or was disabled: drop it */
+        if (PyDict_DelItem(guard_cache, key) < 0) {
+            if (!PyErr_ExceptionMatches(PyExc_KeyError))
+                goto error;
+            PyErr_Clear();
+        }
+    }
+
+    guard_cache_misses++;
+    guard = PyObject_Call(type, guard_args, NULL);
+    if (guard == NULL)
+        goto error;
+    if (PyDict_Size(guard_cache) >= GUARD_CACHE_SIZE
+        && guard_cache_purge() < 0) {
+        Py_DECREF(guard);
+        goto error;
+    }
+    if (PyDict_SetItem(guard_cache, key, guard) < 0) {
+        Py_DECREF(guard);
+        goto error;
+    }
+    Py_DECREF(key);
+    Py_DECREF(guard_args);
+    return guard;
+
+error:
+    Py_XDECREF(key);
+    Py_DECREF(guard_args);
+    return NULL;
 }
 
-PyDoc_STRVAR(specialize_doc,
-"specialize(func, code, guards) -> bool\n"
+PyDoc_STRVAR(shared_guard_doc,
+"shared_guard(guard_type, *args) -> guard\n"
 "\n"
-"Specialize a function: add a specialized code with guards.");
+"Get a guard shared by all callers using the same arguments: guard_type\n"
+"must be GuardDict, GuardGlobals or GuardBuiltins. Return the cached guard\n"
+"created with the same type, dict and keys (and the same globals and\n"
+"builtins of the calling frame) if it still passes, or create a new guard.\n"
+"\n"
+"A single revalidation serves all functions using a shared guard.\n"
+"\n"
+"A cached guard keeps its dict alive. A guard which failed or was disabled\n"
+"is dropped from the cache when it is next looked up. The cache holds at\n"
+"most 1024 guards: when it is full, guards only referenced by the cache and\n"
+"disabled guards are removed, or the oldest guard if all guards are used.\n"
+"clear_guard_cache() removes all cached guards.");
 
 
 static PyObject *
-fat_get_specialized(PyObject *self, PyObject *args)
+fat_get_guard_cache_stats(PyObject *self, PyObject *unused)
 {
-    PyObject *func;
+    return Py_BuildValue("{snsnsn}",
+                         "hits", guard_cache_hits,
+                         "misses", guard_cache_misses,
+                         "size", PyDict_Size(guard_cache));
+}
 
-    if (!PyArg_ParseTuple(args, "O!:get_specialized",
-                          &PyFunction_Type, &func))
-        return NULL;
+PyDoc_STRVAR(get_guard_cache_stats_doc,
+"get_guard_cache_stats() -> dict\n"
+"\n"
+"Get statistics on the guard cache used by shared_guard(): 'hits' (number\n"
+"of calls which returned a cached guard), 'misses' (number of created\n"
+"guards) and 'size' (number of cached guards).");
 
-    return PyFunction_GetSpecializedCodes(func);
+
+static PyObject *
+fat_clear_guard_cache(PyObject *self, PyObject *unused)
+{
+    PyDict_Clear(guard_cache);
+    guard_cache_hits = 0;
+    guard_cache_misses = 0;
+    Py_RETURN_NONE;
 }
 
-PyDoc_STRVAR(get_specialized_doc,
-"get_specialized(func) -> list\n"
+PyDoc_STRVAR(clear_guard_cache_doc,
+"clear_guard_cache()\n"
 "\n"
-"Get the list of specialized codes as a list of (code, guards)\n"
-"tuples where code is a callable or code object and guards is a list\n"
-"of guards.");
+"Remove all guards of the guard cache used by shared_guard() and reset\n"
+"its statistics. Specialized functions keep their guards.");
+
 
 static struct PyMethodDef fat_methods[] = {
     {"specialize", (PyCFunction)fat_specialize, METH_VARARGS,
      specialize_doc},
     {"get_specialized", (PyCFunction)fat_get_specialized, METH_VARARGS,
      get_specialized_doc},
-    {"replace_consts", (PyCFunction)fat_replace_consts, METH_VARARGS,
+    {"get_stats", (PyCFunction)fat_get_stats, METH_VARARGS,
+     get_stats_doc},
+    {"reset_stats", (PyCFunction)fat_reset_stats, METH_VARARGS,
+     reset_stats_doc},
+    {"replace_consts", (PyCFunction)fat_replace_consts,
+     METH_VARARGS | METH_KEYWORDS,
      patch_constants_doc},
     {"guard_type_dict", (PyCFunction)fat_guard_type_dict, METH_VARARGS,
      guard_type_dict_doc},
+    {"inline_globals", (PyCFunction)fat_inline_globals, METH_VARARGS,
+     inline_globals_doc},
+    {"set_deopt_policy", (PyCFunction)fat_set_deopt_policy, METH_VARARGS,
+     set_deopt_policy_doc},
+    {"get_deopt_policy", (PyCFunction)fat_get_deopt_policy, METH_NOARGS,
+     get_deopt_policy_doc},
+    {"attr_index", (PyCFunction)fat_attr_index, METH_VARARGS,
+     attr_index_doc},
+    {"_bench_check", (PyCFunction)fat_bench_check,
+     METH_VARARGS | METH_KEYWORDS,
+     bench_check_doc},
+    {"shared_guard", (PyCFunction)fat_shared_guard, METH_VARARGS,
+     shared_guard_doc},
+    {"get_guard_cache_stats", (PyCFunction)fat_get_guard_cache_stats,
+     METH_NOARGS, get_guard_cache_stats_doc},
+    {"clear_guard_cache", (PyCFunction)fat_clear_guard_cache, METH_NOARGS,
+     clear_guard_cache_doc},
     {NULL, NULL}                /* sentinel */
 };
 
@@ -1203,7 +6449,8 @@ int
 fat_init_builtins(void)
 {
     PyThreadState* tstate;
-    PyObject *builtins;
+    PyObject *builtins, *key, *value;
+    Py_ssize_t pos = 0;
 
     if (init_builtins != NULL)
         /* already initialized */
@@ -1227,7 +6474,24 @@ fat_init_builtins(void)
     if (init_builtins == NULL)
         return -1;
 
+    builtins_watcher = dict_watcher_get(builtins);
+    if (builtins_watcher == NULL)
+        goto error;
+
+    while (PyDict_Next(init_builtins, &pos, &key, &value)) {
+        if (dict_watcher_add_key(builtins_watcher, key) < 0)
+            goto error;
+    }
+    builtins_nkey = builtins_watcher->nkey;
+    builtins_epoch = builtins_watcher->epoch;
+    builtins_modified_epoch = 0;
+
     return 0;
+
+error:
+    Py_CLEAR(builtins_watcher);
+    Py_CLEAR(init_builtins);
+    return -1;
 }
 
 PyMODINIT_FUNC
@@ -1235,6 +6499,20 @@ PyInit_fat(void)
 {
     PyObject *mod, *value;
 
+    if (dict_watchers == NULL) {
+        if (dict_watchers_resize(DICT_WATCHERS_MINSIZE) < 0)
+            return NULL;
+    }
+
+    if (PyType_Ready(&DictWatcher_Type) < 0)
+        return NULL;
+
+    if (guard_cache == NULL) {
+        guard_cache = PyDict_New();
+        if (guard_cache == NULL)
+            return NULL;
+    }
+
     if (fat_init_builtins() < 0)
         return NULL;
 
@@ -1245,15 +6523,45 @@ PyInit_fat(void)
     if (PyType_Ready(&GuardFunc_Type) < 0)
         return NULL;
 
+    if (PyType_Ready(&GuardTypeVersion_Type) < 0)
+        return NULL;
+
+    if (PyType_Ready(&GuardInstanceLayout_Type) < 0)
+        return NULL;
+
+    if (PyType_Ready(&GuardChain_Type) < 0)
+        return NULL;
+
+    if (PyType_Ready(&GuardModuleAttr_Type) < 0)
+        return NULL;
+
     if (PyType_Ready(&GuardArgType_Type) < 0)
         return NULL;
 
+    if (PyType_Ready(&GuardSignature_Type) < 0)
+        return NULL;
+
+    if (PyType_Ready(&GuardTypeDispatch_Type) < 0)
+        return NULL;
+
+    if (PyType_Ready(&GuardArgValue_Type) < 0)
+        return NULL;
+
+    if (PyType_Ready(&GuardArgRange_Type) < 0)
+        return NULL;
+
+    if (PyType_Ready(&GuardArgShape_Type) < 0)
+        return NULL;
+
     if (PyType_Ready(&GuardDict_Type) < 0)
         return NULL;
 
     if (PyType_Ready(&GuardGlobals_Type) < 0)
         return NULL;
 
+    if (PyType_Ready(&GuardFrozenDict_Type) < 0)
+        return NULL;
+
     if (PyType_Ready(&GuardBuiltins_Type) < 0)
         return NULL;
 
@@ -1273,11 +6581,56 @@ PyInit_fat(void)
                            (PyObject *)&GuardFunc_Type) < 0)
         return NULL;
 
+    Py_INCREF(&GuardTypeVersion_Type);
+    if (PyModule_AddObject(mod, "GuardTypeVersion",
+                           (PyObject *)&GuardTypeVersion_Type) < 0)
+        return NULL;
+
+    Py_INCREF(&GuardInstanceLayout_Type);
+    if (PyModule_AddObject(mod, "GuardInstanceLayout",
+                           (PyObject *)&GuardInstanceLayout_Type) < 0)
+        return NULL;
+
+    Py_INCREF(&GuardChain_Type);
+    if (PyModule_AddObject(mod, "GuardChain",
+                           (PyObject *)&GuardChain_Type) < 0)
+        return NULL;
+
+    Py_INCREF(&GuardModuleAttr_Type);
+    if (PyModule_AddObject(mod, "GuardModuleAttr",
+                           (PyObject *)&GuardModuleAttr_Type) < 0)
+        return NULL;
+
     Py_INCREF(&GuardArgType_Type);
     if (PyModule_AddObject(mod, "GuardArgType",
                            (PyObject *)&GuardArgType_Type) < 0)
         return NULL;
 
+    Py_INCREF(&GuardSignature_Type);
+    if (PyModule_AddObject(mod, "GuardSignature",
+                           (PyObject *)&GuardSignature_Type) < 0)
+        return NULL;
+
+    Py_INCREF(&GuardTypeDispatch_Type);
+    if (PyModule_AddObject(mod, "GuardTypeDispatch",
+                           (PyObject *)&GuardTypeDispatch_Type) < 0)
+        return NULL;
+
+    Py_INCREF(&GuardArgValue_Type);
+    if (PyModule_AddObject(mod, "GuardArgValue",
+                           (PyObject *)&GuardArgValue_Type) < 0)
+        return NULL;
+
+    Py_INCREF(&GuardArgRange_Type);
+    if (PyModule_AddObject(mod, "GuardArgRange",
+                           (PyObject *)&GuardArgRange_Type) < 0)
+        return NULL;
+
+    Py_INCREF(&GuardArgShape_Type);
+    if (PyModule_AddObject(mod, "GuardArgShape",
+                           (PyObject *)&GuardArgShape_Type) < 0)
+        return NULL;
+
     Py_INCREF(&GuardDict_Type);
     if (PyModule_AddObject(mod, "GuardDict",
                            (PyObject *)&GuardDict_Type) < 0)
@@ -1293,5 +6646,10 @@ PyInit_fat(void)
                            (PyObject *)&GuardBuiltins_Type) < 0)
         return NULL;
 
+    Py_INCREF(&GuardFrozenDict_Type);
+    if (PyModule_AddObject(mod, "GuardFrozenDict",
+                           (PyObject *)&GuardFrozenDict_Type) < 0)
+        return NULL;
+
     return mod;
 }
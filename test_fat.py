@@ -2,11 +2,20 @@
 __fatoptimizer__ = {'enabled': False}
 
 import builtins
+import collections
 import fat
+import gc
 import os.path
 import sys
 import textwrap
+import types
 import unittest
+import weakref
+
+
+# fat.get_stats() only gives the number of checks if fat was compiled
+# with FAT_STATS=0
+FAT_STATS = ('slow' in fat.get_stats(fat.GuardDict({}, 'key')))
 
 
 class GuardsTests(unittest.TestCase):
@@ -24,9 +33,164 @@ class GuardsTests(unittest.TestCase):
         self.assertEqual(guard(1, 2, 3), 0)
         self.assertEqual(guard(1, 2, "hello"), 1)
 
-        # FIXME: keywords are not supported yet
+        # the parameter name is unknown until the guard is used to
+        # specialize a function
+        self.assertIsNone(guard.arg_name)
         self.assertEqual(guard(1, 2, arg=3), 1)
 
+    def test_guard_arg_type_keyword(self):
+        def func(a, b, c):
+            pass
+
+        def fast(a, b, c):
+            pass
+
+        guard = fat.GuardArgType(2, (int,))
+        fat.specialize(func, fast, [guard])
+        self.assertEqual(guard.arg_name, 'c')
+
+        self.assertEqual(guard(1, 2, c=3), 0)
+        self.assertEqual(guard(1, 2, c="hello"), 1)
+        self.assertEqual(guard(1, c=3, b=2), 0)
+        self.assertEqual(guard(1, b=2, c="hello"), 1)
+        self.assertEqual(guard(1, 2, d=3), 1)
+        self.assertEqual(guard(1, 2, 3, d=3), 0)
+
+    def test_guard_arg_index(self):
+        def func(a, b):
+            pass
+
+        def fast(a, b):
+            pass
+
+        obj = types.SimpleNamespace(x=1)
+        for guard_type, args in ((fat.GuardArgType, ((int,),)),
+                                 (fat.GuardArgValue, ((1,),)),
+                                 (fat.GuardArgRange, ()),
+                                 (fat.GuardArgShape, (tuple,)),
+                                 (fat.GuardInstanceLayout, (obj,))):
+            self.assertRaises(ValueError, guard_type, -1, *args)
+
+        # initialize again a bound guard: the guard is unbound
+        guard = fat.GuardArgType(1, (int,))
+        fat.specialize(func, fast, [guard])
+        self.assertEqual(guard.arg_name, 'b')
+        refcnt = sys.getrefcount(func)
+        guard.__init__(0, (str,))
+        self.assertEqual(sys.getrefcount(func), refcnt - 1)
+        self.assertIsNone(guard.arg_name)
+        self.assertEqual(guard.arg_types, (str,))
+        self.assertEqual(guard("x", 1), 0)
+
+    def test_guard_signature(self):
+        guard = fat.GuardSignature((int, (int, float), None))
+        self.assertEqual(guard.arg_types, ((int,), (int, float), None))
+
+        self.assertEqual(guard(1, 2, 3), 0)
+        self.assertEqual(guard(1, 2.0, "str"), 0)
+        self.assertEqual(guard(1, 2.0, "str", 4), 0)
+        self.assertEqual(guard(1.0, 2, 3), 1)
+        self.assertEqual(guard(1, "str", 3), 1)
+
+        # missing arguments
+        self.assertEqual(guard(1, 2), 1)
+
+        self.assertRaises(ValueError, fat.GuardSignature, ())
+        self.assertRaises(TypeError, fat.GuardSignature, (123,))
+        self.assertRaises(TypeError, fat.GuardSignature, ((int, 123),))
+
+    def test_guard_signature_keyword(self):
+        def func(a, b=2, *, c=3.0):
+            pass
+
+        def fast(a, b=2, *, c=3.0):
+            pass
+
+        guard = fat.GuardSignature((int, int, float))
+        fat.specialize(func, fast, [guard])
+
+        # keyword arguments and default values
+        self.assertEqual(guard(1, 2, c=3.0), 0)
+        self.assertEqual(guard(1, b=2), 0)
+        self.assertEqual(guard(1), 0)
+        self.assertEqual(guard(1, b="str"), 1)
+        self.assertEqual(guard(1, c=3), 1)
+
+    def test_guard_type_dispatch(self):
+        guard = fat.GuardTypeDispatch((0, 1))
+        self.assertEqual(guard.arg_indexes, (0, 1))
+        self.assertIsNone(guard.fallback)
+
+        guard.register((int, int), lambda x, y: 'int')
+        guard.register((float, int), lambda x, y: 'float')
+        self.assertEqual(set(guard.table), {(int, int), (float, int)})
+
+        # calling the guard calls the target
+        for i in range(3):
+            self.assertEqual(guard(1, 2), 'int')
+            self.assertEqual(guard(1.0, 2), 'float')
+        self.assertRaises(TypeError, guard, "str", 2)
+
+        # megamorphic call site: more types than cache entries
+        types = [type('Type%s' % i, (), {}) for i in range(20)]
+        for index, cls in enumerate(types):
+            guard.register((cls, int), lambda x, y, index=index: index)
+        for i in range(2):
+            for index, cls in enumerate(types):
+                self.assertEqual(guard(cls(), 2), index)
+
+        # replace a target
+        guard.register((int, int), lambda x, y: 'int2')
+        self.assertEqual(guard(1, 2), 'int2')
+
+        guard = fat.GuardTypeDispatch([0], fallback=lambda x: 'fallback')
+        guard.register(int, lambda x: 'int')
+        self.assertEqual(guard(1), 'int')
+        self.assertEqual(guard("str"), 'fallback')
+
+        self.assertRaises(ValueError, fat.GuardTypeDispatch, ())
+        self.assertRaises(ValueError, guard.register, (int, int), len)
+        self.assertRaises(TypeError, guard.register, (123,), len)
+        self.assertRaises(TypeError, guard.register, (int,), 123)
+
+    def test_guard_type_dispatch_reentrant(self):
+        guard = fat.GuardTypeDispatch([0])
+
+        # the target replaces itself while it is running
+        def target(x):
+            guard.register(int, lambda x: 'new')
+            return [x] * 3
+
+        guard.register(int, target)
+        self.assertEqual(guard(1), [1, 1, 1])
+        self.assertEqual(guard(1), 'new')
+
+        def fallback(x):
+            guard.__init__([0], fallback=lambda x: 'new fallback')
+            return [x] * 3
+
+        guard = fat.GuardTypeDispatch([0], fallback=fallback)
+        self.assertEqual(guard("x"), ["x", "x", "x"])
+        self.assertEqual(guard("x"), 'new fallback')
+
+    def test_guard_type_dispatch_equal_types(self):
+        # types equal to the key of the table, but different objects
+        class Meta(type):
+            def __eq__(self, other):
+                return isinstance(other, Meta)
+
+            def __hash__(self):
+                return 0
+
+        guard = fat.GuardTypeDispatch([0])
+        guard.register(Meta('A', (), {}), lambda x: 'meta')
+        for i in range(20):
+            cls = Meta('B%s' % i, (), {})
+            self.assertEqual(guard(cls()), 'meta')
+            del cls
+            gc.collect()
+        self.assertRaises(TypeError, guard, 1)
+
     def test_guard_dict(self):
         ns = {'key': 1}
 
@@ -39,6 +203,310 @@ class GuardsTests(unittest.TestCase):
         ns['key'] = 2
         self.assertEqual(guard(), 2)
 
+    def test_guard_dict_other_key(self):
+        ns = {'key': 1}
+        guard = fat.GuardDict(ns, 'key')
+
+        # modify other keys and resize the dictionary
+        ns['other'] = 2
+        self.assertEqual(guard(), 0)
+        for i in range(100):
+            ns['key%s' % i] = i
+        self.assertEqual(guard(), 0)
+
+        # remove the key and then set it again with the same value
+        value = ns.pop('key')
+        self.assertEqual(guard(), 2)
+        ns['key'] = value
+        self.assertEqual(guard(), 0)
+
+        ns['key'] = 3
+        self.assertEqual(guard(), 2)
+
+    def test_guard_dict_missing_key(self):
+        ns = {}
+        guard = fat.GuardDict(ns, 'key')
+
+        ns['other'] = 1
+        self.assertEqual(guard(), 0)
+
+        ns['key'] = 2
+        self.assertEqual(guard(), 2)
+
+    def test_guard_dict_shared(self):
+        ns = {'a': 1, 'b': 2}
+        guard_a = fat.GuardDict(ns, 'a')
+        guard_ab = fat.GuardDict(ns, 'a', 'b')
+        guard_b = fat.GuardDict(ns, 'b')
+
+        ns['other'] = 3
+        self.assertEqual(guard_a(), 0)
+        self.assertEqual(guard_ab(), 0)
+        self.assertEqual(guard_b(), 0)
+
+        ns['b'] = 4
+        self.assertEqual(guard_a(), 0)
+        self.assertEqual(guard_ab(), 2)
+        self.assertEqual(guard_b(), 2)
+
+        # new guard created after the modification
+        guard_b = fat.GuardDict(ns, 'b')
+        self.assertEqual(guard_b(), 0)
+        del ns['a']
+        self.assertEqual(guard_b(), 0)
+        self.assertEqual(guard_a(), 2)
+
+    def test_guard_dict_many_dicts(self):
+        # register and unregister the watchers of many dicts
+        dicts = [{'key': i} for i in range(100)]
+        guards = [fat.GuardDict(ns, 'key') for ns in dicts]
+        del guards[::2]
+        del dicts[::2]
+
+        for ns, guard in zip(dicts, guards):
+            self.assertEqual(guard(), 0)
+            # the new guard shares the watcher of the dict
+            guard2 = fat.GuardDict(ns, 'key')
+            ns['key'] = -1
+            self.assertEqual(guard(), 2)
+            self.assertEqual(guard2(), 2)
+
+    def test_guard_dict_reentrant(self):
+        guards = []
+
+        class Key(str):
+            def __eq__(self, other):
+                if not guards:
+                    # watch new keys of the dict during a lookup
+                    keys = ['key%s' % i for i in range(10)]
+                    guards.append(fat.GuardDict(ns, *keys))
+                return str.__eq__(self, other)
+
+            __hash__ = str.__hash__
+
+        ns = {Key('key'): 1, 'key9': 2}
+        guard = fat.GuardDict(ns, 'key')
+        self.assertEqual(len(guards), 1)
+        self.assertEqual(guard(), 0)
+        self.assertEqual(guards[0](), 0)
+
+        ns['key9'] = 3
+        self.assertEqual(guard(), 0)
+        self.assertEqual(guards[0](), 2)
+        ns['key'] = 4
+        self.assertEqual(guard(), 2)
+
+    def test_guard_dict_many_keys(self):
+        keys = ['key%s' % i for i in range(10)]
+        ns = dict.fromkeys(keys, 1)
+        for nkey in range(1, len(keys) + 1):
+            guard = fat.GuardDict(ns, *keys[:nkey])
+            self.assertEqual(guard.keys, tuple(keys[:nkey]))
+            self.assertEqual(guard(), 0)
+
+        guard = fat.GuardDict(ns, *keys)
+        ns[keys[-1]] = 2
+        self.assertEqual(guard(), 2)
+
+    def test_guard_dict_subclass(self):
+        # enum uses an OrderedDict for the class namespace
+        ns = collections.OrderedDict(key=1, other=2)
+        guard = fat.GuardDict(ns, 'key')
+        self.assertIs(guard.dict, ns)
+        ns['other'] = 3
+        self.assertEqual(guard(), 0)
+        ns.move_to_end('key')
+        self.assertEqual(guard(), 0)
+        ns['key'] = 4
+        self.assertEqual(guard(), 2)
+
+        # __getitem__ is used if it is overriden
+        class Namespace(dict):
+            def __getitem__(self, key):
+                return dict.__getitem__(self, key.upper())
+
+        ns = Namespace(KEY=1, OTHER=2)
+        guard = fat.GuardDict(ns, 'key')
+        ns['OTHER'] = 3
+        self.assertEqual(guard(), 0)
+        ns['KEY'] = 4
+        self.assertEqual(guard(), 2)
+
+        self.assertRaises(TypeError, fat.GuardDict, collections.UserDict(),
+                          'key')
+
+        # __getitem__ added to the class after the creation of the guard
+        class Namespace(dict):
+            pass
+
+        ns = Namespace(key=1, KEY=2)
+        guard = fat.GuardDict(ns, 'key')
+
+        def getitem(self, key):
+            return dict.__getitem__(self, key.upper())
+
+        Namespace.__getitem__ = getitem
+        ns['other'] = 3
+        self.assertEqual(guard(), 2)
+
+    def test_guard_dict_mappingproxy(self):
+        class Class:
+            attr = 1
+
+        guard = fat.GuardDict(Class.__dict__, 'attr')
+        # the writable dict of the class is not exposed
+        self.assertIsInstance(guard.dict, types.MappingProxyType)
+        self.assertEqual(guard.dict['attr'], 1)
+        Class.other = 2
+        self.assertEqual(guard(), 0)
+        Class.attr = 3
+        self.assertEqual(guard(), 2)
+
+    def test_guard_frozen_dict(self):
+        ns = {'key': 1, 'other': 2}
+        guard = fat.GuardFrozenDict(ns)
+        self.assertIsInstance(guard, fat.GuardDict)
+        self.assertIs(guard.dict, ns)
+        self.assertEqual(guard.keys, ())
+        self.assertEqual(guard.frozen, 1)
+        self.assertEqual(guard.fallback, 0)
+        self.assertEqual(guard(), 0)
+
+        # any modification fails
+        ns['other'] = 3
+        self.assertEqual(guard(), 2)
+        self.assertEqual(guard.frozen, 1)
+
+        # without fallback, the guard doesn't register a dict watcher:
+        # it only keeps references to the dict and to the mapping
+        ns = {'key': 1}
+        refcnt = sys.getrefcount(ns)
+        guard = fat.GuardFrozenDict(ns)
+        self.assertEqual(sys.getrefcount(ns), refcnt + 2)
+        del guard
+        self.assertEqual(sys.getrefcount(ns), refcnt)
+
+        self.assertRaises(TypeError, fat.GuardFrozenDict, [])
+        self.assertRaises(ValueError, fat.GuardFrozenDict, ns, fallback=True)
+        # keys are only watched with fallback
+        self.assertRaises(ValueError, fat.GuardFrozenDict, ns, 'key')
+        self.assertRaises(TypeError, fat.GuardFrozenDict, ns, 'key', x=1)
+
+    def test_guard_frozen_dict_fallback(self):
+        ns = {'key': 1, 'other': 2}
+        guard = fat.GuardFrozenDict(ns, 'key', fallback=True)
+        self.assertEqual(guard.keys, ('key',))
+        self.assertEqual(guard.fallback, 1)
+        self.assertEqual(guard(), 0)
+
+        # the first modification switches to per-key mode
+        ns['other'] = 3
+        self.assertEqual(guard(), 0)
+        self.assertEqual(guard.frozen, 0)
+        ns['other'] = 4
+        self.assertEqual(guard(), 0)
+
+        ns['key'] = 5
+        self.assertEqual(guard(), 2)
+
+        # the key is modified before the first check
+        ns = {'key': 1}
+        guard = fat.GuardFrozenDict(ns, 'key', fallback=True)
+        ns['key'] = 2
+        self.assertEqual(guard(), 2)
+
+    def test_guard_arg_type_defaults(self):
+        def func(a, b=1, *, c="str"):
+            pass
+
+        def fast(a, b=1, *, c="str"):
+            pass
+
+        guard_b = fat.GuardArgType(1, (int,))
+        guard_c = fat.GuardArgType(2, (str,))
+        fat.specialize(func, fast, [guard_b, guard_c])
+        self.assertEqual(guard_c.arg_name, 'c')
+
+        # default values
+        self.assertEqual(guard_b(0), 0)
+        self.assertEqual(guard_c(0), 0)
+
+        self.assertEqual(guard_b(0, 2.0), 1)
+        self.assertEqual(guard_c(0, c=2), 1)
+
+        # replace defaults
+        func.__defaults__ = (1.0,)
+        self.assertEqual(guard_b(0), 1)
+        func.__kwdefaults__['c'] = 3
+        self.assertEqual(guard_c(0), 1)
+        func.__kwdefaults__ = {'c': "str"}
+        self.assertEqual(guard_c(0), 0)
+
+    def test_guard_arg_type_varargs(self):
+        def func(a, *args):
+            pass
+
+        def fast(a, *args):
+            pass
+
+        guard = fat.GuardArgType(2, (int,))
+        fat.specialize(func, fast, [guard])
+        self.assertIsNone(guard.arg_name)
+
+        self.assertEqual(guard(0, 1, 2), 0)
+        self.assertEqual(guard(0, 1, "str"), 1)
+        self.assertEqual(guard(0, 1), 1)
+
+    def test_guard_arg_type_varargs_kwonly(self):
+        def func(a, *args, b):
+            pass
+
+        def fast(a, *args, b):
+            pass
+
+        # arg_index is an index in positional arguments
+        guard = fat.GuardArgType(1, (int,))
+        fat.specialize(func, fast, [guard])
+        self.assertIsNone(guard.arg_name)
+        self.assertEqual(guard(0, 1, b="str"), 0)
+        self.assertEqual(guard(0, "str", b=1), 1)
+
+    def test_guard_arg_type_shared(self):
+        def func1(a, b=1):
+            pass
+
+        def func2(a, b=2.0):
+            pass
+
+        def func3(b, a):
+            pass
+
+        def fast(a, b=1):
+            pass
+
+        guard = fat.GuardArgType(1, (int,))
+        fat.specialize(func1, fast, [guard])
+        self.assertEqual(guard(0), 0)
+
+        # the guard is shared: default values are not used anymore
+        fat.specialize(func2, fast, [guard])
+        self.assertEqual(guard(0, 1), 0)
+        self.assertEqual(guard(0, b=1), 0)
+        self.assertEqual(guard(0), 1)
+
+        # the parameter has a different name
+        self.assertRaises(ValueError, fat.specialize, func3, fast, [guard])
+
+    def test_guard_arg_type_index_error(self):
+        def func(a):
+            pass
+
+        def fast(a):
+            pass
+
+        with self.assertRaises(ValueError):
+            fat.specialize(func, fast, [fat.GuardArgType(1, (int,))])
+
     def test_globals(self):
         guard = fat.GuardGlobals('key')
         self.assertIs(guard.dict, globals())
@@ -73,6 +541,8 @@ class GuardsTests(unittest.TestCase):
         guard_globals = guard.guard_globals
         self.assertIs(guard_globals.dict, globals())
         self.assertEqual(guard_globals.keys, ('key',))
+        # the same GuardGlobals object is returned at each access
+        self.assertIs(guard.guard_globals, guard_globals)
 
         # not enough parameters
         self.assertRaises(TypeError, fat.GuardBuiltins)
@@ -128,6 +598,64 @@ class GuardsTests(unittest.TestCase):
 
         self.assertEqual(check, 2)
 
+    def test_builtins_modified(self):
+        guard = fat.GuardBuiltins('len')
+        self.assertEqual(guard(), 0)
+
+        # another builtin is modified and then restored
+        orig_chr = builtins.chr
+        builtins.chr = lambda obj: "mock"
+        try:
+            self.assertEqual(guard(), 0)
+        finally:
+            builtins.chr = orig_chr
+        self.assertEqual(guard(), 0)
+
+        # new builtin
+        builtins.fat_test_key = 1
+        try:
+            self.assertEqual(guard(), 0)
+        finally:
+            del builtins.fat_test_key
+
+        orig_len = builtins.len
+        builtins.len = lambda obj: "mock"
+        try:
+            self.assertEqual(guard(), 2)
+        finally:
+            builtins.len = orig_len
+
+    def test_builtins_stay_modified(self):
+        guard = fat.GuardBuiltins('len')
+        self.assertEqual(guard(), 0)
+
+        # another builtin stays modified while builtins are modified again
+        orig_chr = builtins.chr
+        builtins.chr = lambda obj: "mock"
+        try:
+            self.assertEqual(guard(), 0)
+            self.assertEqual(guard(), 0)
+
+            builtins.fat_test_key = 1
+            try:
+                self.assertEqual(guard(), 0)
+            finally:
+                del builtins.fat_test_key
+            self.assertEqual(guard(), 0)
+
+            orig_len = builtins.len
+            builtins.len = lambda obj: "mock"
+            try:
+                self.assertEqual(guard(), 2)
+            finally:
+                builtins.len = orig_len
+        finally:
+            builtins.chr = orig_chr
+
+        # builtins are restored
+        guard = fat.GuardBuiltins('len')
+        self.assertEqual(guard(), 0)
+
     def test_guard_func(self):
         def func():
             return 3
@@ -144,6 +672,452 @@ class GuardsTests(unittest.TestCase):
         func.__code__ = func2.__code__
         self.assertEqual(guard(), 2)
 
+    def test_guard_type_version(self):
+        class Base:
+            def method(self):
+                pass
+
+        class Class(Base):
+            pass
+
+        guard = fat.GuardTypeVersion(Class)
+        self.assertIs(guard.type, Class)
+        self.assertEqual(guard.names, ())
+        self.assertEqual(guard(), 0)
+
+        # modify a base class
+        Base.attr = 1
+        self.assertEqual(guard(), 2)
+
+        guard = fat.GuardTypeVersion(Class, 'method')
+        self.assertEqual(guard.names, ('method',))
+
+        # other attribute modified
+        Base.attr = 2
+        self.assertEqual(guard(), 0)
+        Class.attr = 3
+        self.assertEqual(guard(), 0)
+
+        # method overriden in the class
+        Class.method = lambda self: None
+        self.assertEqual(guard(), 2)
+
+        # wrong types
+        self.assertRaises(TypeError, fat.GuardTypeVersion)
+        self.assertRaises(TypeError, fat.GuardTypeVersion, 123)
+        self.assertRaises(TypeError, fat.GuardTypeVersion, Class, 123)
+
+    def test_guard_instance_layout(self):
+        class Point:
+            def __init__(self, x, y):
+                self.x = x
+                self.y = y
+
+        def func(obj):
+            pass
+
+        def fast(obj):
+            pass
+
+        point = Point(1, 2)
+        guard = fat.GuardInstanceLayout(0, point)
+        fat.specialize(func, fast, [guard])
+        self.assertIs(guard.type, Point)
+        self.assertEqual(guard.arg_name, 'obj')
+
+        self.assertEqual(fat.attr_index(point, 'x'), 0)
+        self.assertEqual(fat.attr_index(point, 'y'), 1)
+        self.assertEqual(fat.attr_index(point, 'z'), -1)
+
+        self.assertEqual(guard(point), 0)
+        self.assertEqual(guard(Point(3, 4)), 0)
+        self.assertEqual(guard("str"), 1)
+
+        # deleting an attribute converts the dictionary to a combined table
+        other = Point(5, 6)
+        del other.x
+        self.assertEqual(guard(other), 1)
+
+        # modify the type
+        Point.attr = 1
+        self.assertEqual(guard(point), 2)
+
+        # no split-keys dictionary
+        self.assertRaises(ValueError, fat.GuardInstanceLayout, 0, 123)
+        self.assertRaises(ValueError, fat.attr_index, 123, 'x')
+
+    def test_guard_instance_layout_values(self):
+        class Value:
+            pass
+
+        class Obj:
+            def __init__(self, attr):
+                self.attr = attr
+
+        # the guard keeps the shared keys alive, but not attribute values
+        obj = Obj(Value())
+        ref = weakref.ref(obj.attr)
+        guard = fat.GuardInstanceLayout(0, obj)
+        del obj
+        self.assertIsNone(ref())
+
+        self.assertEqual(guard(Obj(1)), 0)
+
+    def test_guard_arg_value(self):
+        def func(a, flag=None):
+            pass
+
+        def fast(a, flag=None):
+            pass
+
+        sentinel = object()
+        guard = fat.GuardArgValue(1, [None, True, 5, 2.0, "str", sentinel])
+        fat.specialize(func, fast, [guard])
+        self.assertEqual(guard.arg_name, 'flag')
+        self.assertEqual(guard.values, (None, True, 5, 2.0, "str", sentinel))
+
+        # default value
+        self.assertEqual(guard(0), 0)
+
+        # identity and value
+        self.assertEqual(guard(0, True), 0)
+        self.assertEqual(guard(0, sentinel), 0)
+        self.assertEqual(guard(0, int("5")), 0)
+        self.assertEqual(guard(0, float("2.0")), 0)
+        self.assertEqual(guard(0, "".join(["s", "tr"])), 0)
+        self.assertEqual(guard(0, flag=5), 0)
+
+        # different value or type
+        self.assertEqual(guard(0, False), 1)
+        self.assertEqual(guard(0, 6), 1)
+        self.assertEqual(guard(0, 5.0), 1)
+        self.assertEqual(guard(0, 2), 1)
+        self.assertEqual(guard(0, b"str"), 1)
+        self.assertEqual(guard(0, object()), 1)
+
+        # floats are compared by their representation
+        guard = fat.GuardArgValue(0, [0.0])
+        self.assertEqual(guard(float("0.0")), 0)
+        self.assertEqual(guard(-0.0), 1)
+
+        self.assertRaises(ValueError, fat.GuardArgValue, 0, [])
+        self.assertRaises(TypeError, fat.GuardArgValue, 0, 123)
+
+    def test_guard_arg_range(self):
+        guard = fat.GuardArgRange(0)
+        self.assertEqual(guard.min, -2 ** 63)
+        self.assertEqual(guard.max, 2 ** 63 - 1)
+
+        for value in (0, 1, -1, 2 ** 40, -2 ** 63, 2 ** 63 - 1, 1.5):
+            self.assertEqual(guard(value), 0, value)
+        for value in (2 ** 63, -2 ** 63 - 1, 10 ** 100, float("inf"),
+                      float("nan"), True, "str"):
+            self.assertEqual(guard(value), 1, value)
+
+        guard = fat.GuardArgRange(0, min=0, max=255)
+        self.assertEqual(guard(0), 0)
+        self.assertEqual(guard(255), 0)
+        self.assertEqual(guard(256), 1)
+        self.assertEqual(guard(-1), 1)
+        self.assertEqual(guard(2 ** 40), 1)
+
+        self.assertRaises(ValueError, fat.GuardArgRange, 0, 5, 1)
+        self.assertRaises(OverflowError, fat.GuardArgRange, 0, 0, 2 ** 64)
+
+    def test_guard_arg_shape(self):
+        guard = fat.GuardArgShape(0, tuple, 3, (float, float, float))
+        self.assertIs(guard.container_type, tuple)
+        self.assertEqual(guard.length, 3)
+        self.assertEqual(guard.item_types, (float, float, float))
+
+        self.assertEqual(guard((1.0, 2.0, 3.0)), 0)
+        self.assertEqual(guard((1.0, 2.0)), 1)
+        self.assertEqual(guard((1.0, 2.0, 3.0, 4.0)), 1)
+        self.assertEqual(guard((1.0, 2, 3.0)), 1)
+        self.assertEqual(guard([1.0, 2.0, 3.0]), 1)
+        self.assertEqual(guard("abc"), 1)
+
+        # only check the type of the first items, any length
+        guard = fat.GuardArgShape(0, list, item_types=(int, None))
+        self.assertIsNone(guard.length)
+        self.assertEqual(guard.item_types, (int, None))
+        self.assertEqual(guard([1, "x"]), 0)
+        self.assertEqual(guard([1, "x", 3.0, None]), 0)
+        self.assertEqual(guard([1]), 1)
+        self.assertEqual(guard(["x", 1]), 1)
+
+        # only check the length
+        guard = fat.GuardArgShape(0, tuple, 2)
+        self.assertEqual(guard((1, "x")), 0)
+        self.assertEqual(guard((1,)), 1)
+
+        self.assertRaises(TypeError, fat.GuardArgShape, 0, dict)
+        self.assertRaises(ValueError, fat.GuardArgShape, 0, tuple, -1)
+        self.assertRaises(ValueError, fat.GuardArgShape, 0, tuple, 1, (int, int))
+        self.assertRaises(TypeError, fat.GuardArgShape, 0, tuple, 1, (1,))
+
+    def test_guard_chain(self):
+        def func(a, b):
+            pass
+
+        def fast(a, b):
+            pass
+
+        guard_builtins = fat.GuardBuiltins('len')
+        guard_a = fat.GuardArgType(0, (int,))
+        guard_b = fat.GuardArgType(1, (int,))
+        guard = fat.GuardChain([guard_builtins, guard_a, guard_b],
+                               reorder_period=10)
+        self.assertEqual(guard.reorder_period, 10)
+        # cheap guards are checked first
+        self.assertEqual(guard.guards, [guard_a, guard_b, guard_builtins])
+
+        fat.specialize(func, fast, [guard])
+        self.assertEqual(guard(1, 2), 0)
+        self.assertEqual(guard("x", 2), 1)
+
+        # the guard which fails is moved first
+        for i in range(20):
+            self.assertEqual(guard(1, "x"), 1)
+        self.assertEqual(guard.guards, [guard_b, guard_a, guard_builtins])
+        self.assertEqual(guard(1, 2), 0)
+
+        guard = fat.GuardChain([guard_builtins, guard_a], reorder_period=0)
+        self.assertEqual(guard.guards, [guard_a, guard_builtins])
+
+        self.assertRaises(ValueError, fat.GuardChain, [])
+        self.assertRaises(TypeError, fat.GuardChain, [len])
+        self.assertRaises(ValueError, fat.GuardChain, [guard_a],
+                          reorder_period=-1)
+
+    def test_guard_chain_reentrant(self):
+        calls = []
+
+        class Namespace(dict):
+            def __getitem__(self, key):
+                if calls:
+                    calls.pop()()
+                return dict.__getitem__(self, key)
+
+        ns = Namespace(key=1)
+        guard_a = fat.GuardArgType(0, (int,))
+        guard_dict = fat.GuardDict(ns, 'key')
+        guard = fat.GuardChain([guard_dict, guard_a], reorder_period=1)
+
+        # check the chain again during a check
+        calls.append(lambda: self.assertEqual(guard("x"), 1))
+        ns['other'] = 1
+        self.assertEqual(guard(1), 0)
+        self.assertEqual(guard.guards, [guard_a, guard_dict])
+
+        # the guards cannot be replaced during a check
+        calls.append(lambda: guard.__init__([guard_a]))
+        ns['other'] = 2
+        self.assertRaises(RuntimeError, guard, 1)
+        self.assertEqual(guard.guards, [guard_a, guard_dict])
+        self.assertEqual(guard(1), 0)
+
+    def test_guard_module_attr(self):
+        # the module name is looked up in the globals of the caller
+        guard = fat.GuardModuleAttr('os.path.join')
+        self.assertEqual(guard.name, 'os.path.join')
+        self.assertIs(guard.value, os.path.join)
+        self.assertEqual(guard(), 0)
+
+        # modify other names of the modules
+        os.path.fat_test = 1
+        self.addCleanup(delattr, os.path, 'fat_test')
+        self.assertEqual(guard(), 0)
+
+        # replace a module of the chain
+        path = os.path
+        try:
+            os.path = textwrap
+            self.assertEqual(guard(), 2)
+        finally:
+            os.path = path
+
+        guard = fat.GuardModuleAttr('textwrap.dedent')
+        dedent = textwrap.dedent
+        try:
+            textwrap.dedent = len
+            self.assertEqual(guard(), 2)
+        finally:
+            textwrap.dedent = dedent
+
+        # invalid name, missing attribute or unknown module
+        for name in ('os', 'os.', 'os.fat_missing', 'fat_missing.x'):
+            with self.assertRaises(ValueError):
+                fat.GuardModuleAttr(name)
+        # os.sep is not a module
+        with self.assertRaises(TypeError):
+            fat.GuardModuleAttr('os.sep.x')
+
+
+class DeoptPolicyTests(unittest.TestCase):
+    def setUp(self):
+        transformers = sys.get_code_transformers()
+        self.addCleanup(sys.set_code_transformers, transformers)
+        sys.set_code_transformers([])
+
+        policy = fat.get_deopt_policy()
+        self.addCleanup(fat.set_deopt_policy, *policy)
+
+    def test_default(self):
+        fat.set_deopt_policy(0, 10)
+        guard = fat.GuardArgType(0, (int,))
+        for i in range(100):
+            self.assertEqual(guard("str"), 1)
+        self.assertFalse(guard.disabled)
+        self.assertEqual(guard(1), 0)
+
+    def test_disable(self):
+        fat.set_deopt_policy(3, 100)
+        guard = fat.GuardArgType(0, (int,))
+        self.assertEqual(guard(1), 0)
+        self.assertEqual(guard("str"), 1)
+        self.assertEqual(guard("str"), 1)
+        self.assertFalse(guard.disabled)
+
+        self.assertEqual(guard("str"), 2)
+        self.assertTrue(guard.disabled)
+
+        # a disabled guard always fails
+        self.assertEqual(guard(1), 2)
+
+    def test_reset_stats(self):
+        fat.set_deopt_policy(3, 100)
+        guard = fat.GuardArgType(0, (int,))
+        self.assertEqual(guard("str"), 1)
+        self.assertEqual(guard("str"), 1)
+
+        # failures before the reset are forgotten
+        fat.reset_stats(guard)
+        self.assertEqual(guard("str"), 1)
+        self.assertEqual(guard("str"), 1)
+        self.assertFalse(guard.disabled)
+
+    def test_decay(self):
+        fat.set_deopt_policy(3, 4)
+        guard = fat.GuardArgType(0, (int,))
+        for i in range(10):
+            self.assertEqual(guard(1), 0)
+            self.assertEqual(guard(1), 0)
+            self.assertEqual(guard(1), 0)
+            self.assertEqual(guard("str"), 1)
+        self.assertFalse(guard.disabled)
+
+    def test_remove_specialized(self):
+        def func(x):
+            return 'slow'
+
+        def fast(x):
+            return 'fast'
+
+        fat.set_deopt_policy(2, 100)
+        fat.specialize(func, fast, [fat.GuardArgType(0, (int,))])
+
+        self.assertEqual(func(1), 'fast')
+        self.assertEqual(func("str"), 'slow')
+        self.assertEqual(len(fat.get_specialized(func)), 1)
+
+        # the guard is disabled: the specialized code must be removed
+        self.assertEqual(func("str"), 'slow')
+        self.assertEqual(fat.get_specialized(func), [])
+        self.assertEqual(func(1), 'slow')
+
+    def test_errors(self):
+        self.assertRaises(ValueError, fat.set_deopt_policy, -1, 10)
+        self.assertRaises(ValueError, fat.set_deopt_policy, 1, 0)
+
+
+@unittest.skipUnless(FAT_STATS, 'need fat compiled with FAT_STATS=1')
+class StatsTests(unittest.TestCase):
+    def setUp(self):
+        transformers = sys.get_code_transformers()
+        self.addCleanup(sys.set_code_transformers, transformers)
+        sys.set_code_transformers([])
+
+    def test_guard_dict(self):
+        ns = {'key': 1}
+        guard = fat.GuardDict(ns, 'key')
+        self.assertEqual(fat.get_stats(guard),
+                         {'checks': 0, 'fails': 0, 'fast': 0, 'slow': 0})
+
+        self.assertEqual(guard(), 0)
+        ns['other'] = 2
+        self.assertEqual(guard(), 0)
+        self.assertEqual(guard(), 0)
+        ns['key'] = 3
+        self.assertEqual(guard(), 2)
+        self.assertEqual(fat.get_stats(guard),
+                         {'checks': 4, 'fails': 1, 'fast': 2, 'slow': 2})
+
+        fat.reset_stats(guard)
+        self.assertEqual(fat.get_stats(guard),
+                         {'checks': 0, 'fails': 0, 'fast': 0, 'slow': 0})
+
+    def test_guard_dict_shared(self):
+        ns = {'key': 1}
+        guard1 = fat.GuardDict(ns, 'key')
+        guard2 = fat.GuardDict(ns, 'key')
+
+        # the first guard revalidates the dict for all guards, the second
+        # guard only catches up with the epoch of the shared watcher
+        ns['other'] = 2
+        self.assertEqual(guard1(), 0)
+        self.assertEqual(guard2(), 0)
+        self.assertEqual(fat.get_stats(guard1),
+                         {'checks': 1, 'fails': 0, 'fast': 0, 'slow': 1})
+        self.assertEqual(fat.get_stats(guard2),
+                         {'checks': 1, 'fails': 0, 'fast': 0, 'slow': 1})
+
+        # then the version of the dict is the only comparison
+        self.assertEqual(guard2(), 0)
+        self.assertEqual(fat.get_stats(guard2),
+                         {'checks': 2, 'fails': 0, 'fast': 1, 'slow': 1})
+
+    def test_guard_builtins_stay_modified(self):
+        guard = fat.GuardBuiltins('len')
+        self.assertEqual(guard(), 0)
+
+        # while another builtin stays modified, only the first check after
+        # the modification revalidates the guard
+        orig_chr = builtins.chr
+        builtins.chr = lambda obj: "mock"
+        try:
+            self.assertEqual(guard(), 0)
+            self.assertEqual(guard(), 0)
+            self.assertEqual(guard(), 0)
+        finally:
+            builtins.chr = orig_chr
+        self.assertEqual(fat.get_stats(guard),
+                         {'checks': 4, 'fails': 0, 'fast': 3, 'slow': 1})
+
+    def test_func(self):
+        def func(x):
+            return 'slow'
+
+        def fast(x):
+            return 'fast'
+
+        ns = {'key': 1}
+        guards = [fat.GuardArgType(0, (int,)), fat.GuardDict(ns, 'key')]
+        fat.specialize(func, fast, guards)
+
+        self.assertEqual(func(1), 'fast')
+        self.assertEqual(func("str"), 'slow')
+        self.assertEqual(fat.get_stats(func),
+                         {'checks': 3, 'fails': 1, 'fast': 3, 'slow': 0})
+
+        fat.reset_stats(func)
+        self.assertEqual(fat.get_stats(guards[0]),
+                         {'checks': 0, 'fails': 0, 'fast': 0, 'slow': 0})
+
+    def test_errors(self):
+        self.assertRaises(TypeError, fat.get_stats, 123)
+        self.assertRaises(TypeError, fat.reset_stats, 123)
+
 
 def guard_dict(ns, key):
     return [fat.GuardDict(ns, key)]
@@ -503,8 +1477,8 @@ class BehaviourTests(BaseTestCase):
 
         self.assertEqual(func(3), 'fast: 3')
 
-        # FIXME: implement keywords
-        #self.assertEqual(func(x=4), 'fast: 4')
+        self.assertEqual(func(x=4), 'fast: 4')
+        self.assertEqual(func(x=4.0), 'slow: 4.0')
 
         # calling with the wrong number of parameter must not disable the
         # optimization
@@ -520,6 +1494,26 @@ class BehaviourTests(BaseTestCase):
         # optimization must not be disabled after call with wrong types
         self.assertEqual(func(7), 'fast: 7')
 
+    def test_type_dispatch(self):
+        def func(x):
+            return 'slow'
+
+        def fast_int(x):
+            return 'int'
+
+        def fast_str(x):
+            return 'str'
+
+        guard = fat.GuardTypeDispatch((0,))
+        guard.register(int, fast_int)
+        guard.register(str, fast_str)
+        fat.specialize(func, guard, [guard])
+
+        self.assertEqual(func(1), 'int')
+        self.assertEqual(func("abc"), 'str')
+        self.assertEqual(func(1.0), 'slow')
+        self.assertEqual(func(1), 'int')
+
     def test_builtin_guard_builtin_replaced(self):
         code = textwrap.dedent("""
             import fat
@@ -979,6 +1973,195 @@ class MiscTests(BaseTestCase):
         code3 = fat.replace_consts(code, {'unknown': 7})
         self.assertEqual(code3.co_consts, (None, 3))
 
+    def test_replace_constants_recursive(self):
+        def func(x):
+            data = [y * 3 for y in x]
+            return (data, 3.0, True, (1, 3), x in {3, 4}, lambda: 3)
+
+        code = func.__code__
+        code2 = fat.replace_consts(code, {3: 'new'}, recursive=True)
+
+        # 3.0 and True are not replaced
+        consts = code2.co_consts
+        self.assertIn(3.0, consts)
+        self.assertIn(True, consts)
+        self.assertIn((1, 'new'), consts)
+        self.assertIn(frozenset({'new', 4}), consts)
+
+        nested = [const for const in consts if isinstance(const, type(code))]
+        self.assertEqual(len(nested), 2)
+        for nested_code in nested:
+            self.assertIn('new', nested_code.co_consts)
+            self.assertNotIn(3, nested_code.co_consts)
+
+        # unchanged nested code objects are not rebuilt
+        code3 = fat.replace_consts(code, {'unknown': 7}, recursive=True)
+        self.assertEqual(code3.co_consts, code.co_consts)
+        for const, const3 in zip(code.co_consts, code3.co_consts):
+            self.assertIs(const, const3)
+
+        # 1 and True are different constants
+        def func(x):
+            return (x, 1, True)
+
+        code = func.__code__
+        code2 = fat.replace_consts(code, {True: 2}, recursive=True)
+        self.assertEqual(code2.co_consts, (None, 1, 2))
+        self.assertIs(type(code2.co_consts[1]), int)
+
+    def test_inline_globals(self):
+        def func(x):
+            return len(x) + CONST
+
+        code = fat.inline_globals(func.__code__, {'len': len, 'CONST': 5})
+        self.assertIn(len, code.co_consts)
+        self.assertIn(5, code.co_consts)
+
+        # the new code doesn't load globals nor builtins anymore
+        func2 = types.FunctionType(code, {'__builtins__': {}})
+        self.assertEqual(func2("abc"), 8)
+
+        # use values captured by a guard
+        guard = fat.GuardBuiltins('len')
+        code = fat.inline_globals(func.__code__, guard)
+        self.assertIn(len, code.co_consts)
+        self.assertIn('CONST', code.co_names)
+
+        self.assertRaises(TypeError, fat.inline_globals, code, [])
+
+    def test_inline_globals_frozen_dict(self):
+        def func(x):
+            return x + CONST
+
+        # a GuardFrozenDict without key captures the whole dict
+        ns = {'CONST': 5}
+        guard = fat.GuardFrozenDict(ns)
+        code = fat.inline_globals(func.__code__, guard)
+        self.assertIn(5, code.co_consts)
+        func2 = types.FunctionType(code, {})
+        self.assertEqual(func2(1), 6)
+
+        # the dict was modified since the guard creation
+        ns['CONST'] = 7
+        self.assertRaises(ValueError, fat.inline_globals, func.__code__, guard)
+
+        # with fallback, values of the keys captured by the guard are used
+        ns = {'CONST': 5, 'other': 1}
+        guard = fat.GuardFrozenDict(ns, 'CONST', fallback=True)
+        code = fat.inline_globals(func.__code__, guard)
+        self.assertIn(5, code.co_consts)
+
+    def test_inline_globals_load_name(self):
+        code = compile("y = len(x)", "<string>", "exec")
+        code = fat.inline_globals(code, {'len': len, 'x': [1, 2]})
+        ns = {'__builtins__': {}}
+        exec(code, ns)
+        self.assertEqual(ns['y'], 2)
+
+        # a stored name is not replaced
+        code = compile("x = 1\ny = x", "<string>", "exec")
+        code = fat.inline_globals(code, {'x': 5})
+        ns = {}
+        exec(code, ns)
+        self.assertEqual(ns['y'], 1)
+
+    def test_inline_globals_store_global(self):
+        def func():
+            global INLINE_GLOBAL
+            INLINE_GLOBAL = 2
+            return INLINE_GLOBAL
+
+        self.addCleanup(globals().pop, 'INLINE_GLOBAL', None)
+
+        # a global stored by the code is not replaced
+        code = fat.inline_globals(func.__code__, {'INLINE_GLOBAL': 5})
+        self.assertNotIn(5, code.co_consts)
+        func2 = types.FunctionType(code, globals())
+        self.assertEqual(func2(), 2)
+
+    def test_bench_check(self):
+        ns = {'key': 1}
+        guard = fat.GuardDict(ns, 'key')
+        dt, res = fat._bench_check(guard, loops=10)
+        self.assertIsInstance(dt, float)
+        self.assertEqual(res, 0)
+
+        dt, res = fat._bench_check(guard, loops=10, modify=(ns, 'key'))
+        self.assertEqual(res, 2)
+
+        guard = fat.GuardArgType(0, (int,))
+        self.assertEqual(fat._bench_check(guard, (1,), loops=10)[1], 0)
+        self.assertEqual(fat._bench_check(guard, ("x",), loops=10)[1], 1)
+
+        self.assertRaises(TypeError, fat._bench_check, 123)
+        self.assertRaises(ValueError, fat._bench_check, guard, loops=0)
+
+    def test_bench_check_stats(self):
+        self.addCleanup(fat.set_deopt_policy, *fat.get_deopt_policy())
+        fat.set_deopt_policy(2, 1000)
+
+        # the benchmark doesn't change statistics nor disable the guard
+        guard = fat.GuardArgType(0, (int,))
+        stats = fat.get_stats(guard)
+        self.assertEqual(fat._bench_check(guard, ("x",), loops=10)[1], 1)
+        self.assertEqual(fat.get_stats(guard), stats)
+        self.assertFalse(guard.disabled)
+        self.assertEqual(fat.get_deopt_policy(), (2, 1000))
+
+    def test_shared_guard(self):
+        fat.clear_guard_cache()
+        self.addCleanup(fat.clear_guard_cache)
+
+        ns = {'key': 1}
+        guard = fat.shared_guard(fat.GuardDict, ns, 'key')
+        self.assertIsInstance(guard, fat.GuardDict)
+        self.assertIs(fat.shared_guard(fat.GuardDict, ns, 'key'), guard)
+        self.assertIsNot(fat.shared_guard(fat.GuardDict, ns, 'key', 'x'),
+                         guard)
+        self.assertIsNot(fat.shared_guard(fat.GuardDict, {'key': 1}, 'key'),
+                         guard)
+        self.assertEqual(fat.get_guard_cache_stats(),
+                         {'hits': 1, 'misses': 3, 'size': 3})
+
+        # a guard which fails is replaced
+        ns['key'] = 2
+        guard2 = fat.shared_guard(fat.GuardDict, ns, 'key')
+        self.assertIsNot(guard2, guard)
+        self.assertEqual(guard(), 2)
+        self.assertEqual(guard2(), 0)
+
+        guard = fat.shared_guard(fat.GuardBuiltins, 'len')
+        self.assertIsInstance(guard, fat.GuardBuiltins)
+        self.assertIs(fat.shared_guard(fat.GuardBuiltins, 'len'), guard)
+        guard = fat.shared_guard(fat.GuardGlobals, 'len')
+        self.assertIsInstance(guard, fat.GuardGlobals)
+        self.assertIs(fat.shared_guard(fat.GuardGlobals, 'len'), guard)
+
+        self.assertRaises(TypeError, fat.shared_guard, fat.GuardFunc, len)
+        self.assertRaises(TypeError, fat.shared_guard, fat.GuardDict, ns, 1)
+
+        fat.clear_guard_cache()
+        self.assertEqual(fat.get_guard_cache_stats(),
+                         {'hits': 0, 'misses': 0, 'size': 0})
+
+    def test_shared_guard_bounded(self):
+        fat.clear_guard_cache()
+        self.addCleanup(fat.clear_guard_cache)
+
+        # a guard which failed is dropped from the cache
+        ns = {'key': 1}
+        guard = fat.shared_guard(fat.GuardDict, ns, 'key')
+        ns['key'] = 2
+        used = fat.shared_guard(fat.GuardDict, ns, 'key')
+        self.assertIsNot(used, guard)
+        self.assertEqual(fat.get_guard_cache_stats()['size'], 1)
+
+        # guards only referenced by the cache are removed when it is full
+        for i in range(2000):
+            fat.shared_guard(fat.GuardDict, {'key': i}, 'key')
+        self.assertLess(fat.get_guard_cache_stats()['size'], 2000)
+        self.assertIs(fat.shared_guard(fat.GuardDict, ns, 'key'), used)
+
     def test_version(self):
         import setup
         self.assertEqual(fat.__version__, setup.VERSION)